@@ -0,0 +1,230 @@
+// Kevin Stock
+
+// This file contains checkpoints of a run, so that one that is stopped or
+// preempted can be resumed where it left off. The state of the
+// metaheuristic is put in a ckpt buffer by mh_save in mh.c, between
+// batches, and written to checkpoint_path every checkpoint_interval
+// seconds, and when the run stops, by a thread of its own, so the disk
+// never holds up evaluation. If that thread is still writing the last
+// one when the next is due, it is skipped rather than waited for.
+//
+// A checkpoint is written to <path>.tmp, flushed to disk and then renamed
+// over path, so path always holds a whole checkpoint. Values are stored
+// as they are in memory, so a checkpoint is only read back on the same
+// kind of machine.
+//
+// A run given checkpoint_path resumes from it if it exists. The run
+// continues exactly as it would have if it had not stopped, as long as it
+// has the same options and number of threads, or -deterministic.
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "wiproj.h"
+
+#define CKPT_MAGIC "wiproj checkpoint 2\n"
+
+char* checkpoint_path = NULL;
+double checkpoint_interval = 300;
+
+pthread_t ckpt_thread;
+pthread_mutex_t ckpt_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t ckpt_cond = PTHREAD_COND_INITIALIZER;
+ckpt* ckpt_pending = NULL; // waiting for the thread, guarded by ckpt_lock
+int ckpt_busy = 0;         // the thread is writing one
+int ckpt_started = 0;
+int ckpt_done = 0;         // no more will come
+double ckpt_last;
+
+void ckpt_put(ckpt* c, const void* p, size_t n) {
+  if (c->size + n > c->capacity) {
+    c->capacity = MAX(2 * c->capacity, c->size + n);
+    c->data = realloc(c->data, c->capacity);
+    if (c->data == NULL) {
+      printf("Failed to allocate memory.\n");
+      exit(0);
+    }
+  }
+  memcpy(c->data + c->size, p, n);
+  c->size += n;
+}
+
+void ckpt_get(ckpt* c, void* p, size_t n) {
+  if (c->pos + n > c->size) {
+    printf("Checkpoint %s is truncated.\n", checkpoint_path);
+    exit(0);
+  }
+  memcpy(p, c->data + c->pos, n);
+  c->pos += n;
+}
+
+void free_ckpt(ckpt* c) {
+  free(c->data);
+  free(c);
+}
+
+// Writes c to checkpoint_path, replacing the last one only once it is
+// safely on disk
+void ckpt_write(ckpt* c) {
+  size_t len = strlen(checkpoint_path) + 5;
+  char* tmp = checked_malloc(len);
+  snprintf(tmp, len, "%s.tmp", checkpoint_path);
+  FILE* out = fopen(tmp, "wb");
+  if (out == NULL ||
+      fwrite(c->data, 1, c->size, out) != c->size ||
+      fflush(out) != 0 || fsync(fileno(out)) != 0) {
+    printf("Failed to write checkpoint %s.\n", tmp);
+  } else if (rename(tmp, checkpoint_path) != 0) {
+    printf("Failed to replace checkpoint %s.\n", checkpoint_path);
+  }
+  if (out)
+    fclose(out);
+  free(tmp);
+}
+
+void* ckpt_writer(void* arg) {
+  pthread_mutex_lock(&ckpt_lock);
+  for (;;) {
+    while (ckpt_pending == NULL && !ckpt_done)
+      pthread_cond_wait(&ckpt_cond, &ckpt_lock);
+    if (ckpt_pending == NULL)
+      break;
+    ckpt* c = ckpt_pending;
+    ckpt_pending = NULL;
+    ckpt_busy = 1;
+    pthread_mutex_unlock(&ckpt_lock);
+    ckpt_write(c);
+    free_ckpt(c);
+    pthread_mutex_lock(&ckpt_lock);
+    ckpt_busy = 0;
+    pthread_cond_broadcast(&ckpt_cond);
+  }
+  pthread_mutex_unlock(&ckpt_lock);
+  return NULL;
+}
+
+// How candidates are evaluated, which the state depends on: errors are
+// of one pyramid level and metric
+void ckpt_modes(int* m) {
+  m[0] = pyramid_levels;
+  m[1] = inc_enabled;
+  m[2] = diff_metric;
+}
+
+// The state of the run, with a header to check it against on resuming
+ckpt* checkpoint_take() {
+  ckpt* c = calloc(1, sizeof(ckpt));
+  if (c == NULL) {
+    printf("Failed to allocate memory.\n");
+    exit(0);
+  }
+  int threads = omp_get_max_threads(), modes[3];
+  ckpt_modes(modes);
+  ckpt_put(c, CKPT_MAGIC, strlen(CKPT_MAGIC));
+  ckpt_put(c, &isource->width, sizeof(int));
+  ckpt_put(c, &isource->height, sizeof(int));
+  ckpt_put(c, &threads, sizeof(int));
+  ckpt_put(c, modes, sizeof(modes));
+  mh_save(c);
+  return c;
+}
+
+// Called by a driver between batches; takes a checkpoint if one is due
+// and the last has been written
+void checkpoint_tick() {
+  if (checkpoint_path == NULL ||
+      omp_get_wtime() - ckpt_last < checkpoint_interval)
+    return;
+
+  pthread_mutex_lock(&ckpt_lock);
+  int idle = ckpt_pending == NULL && !ckpt_busy;
+  pthread_mutex_unlock(&ckpt_lock);
+  if (!idle)
+    return;
+  ckpt_last = omp_get_wtime();
+
+  ckpt* c = checkpoint_take();
+  pthread_mutex_lock(&ckpt_lock);
+  if (!ckpt_started) {
+    if (pthread_create(&ckpt_thread, NULL, ckpt_writer, NULL) != 0) {
+      printf("Failed to start the checkpoint thread.\n");
+      exit(0);
+    }
+    ckpt_started = 1;
+  }
+  ckpt_pending = c;
+  pthread_cond_signal(&ckpt_cond);
+  pthread_mutex_unlock(&ckpt_lock);
+}
+
+// Called by a driver when the run stops; takes a last checkpoint and
+// waits for it to be written
+void checkpoint_finish() {
+  if (checkpoint_path == NULL)
+    return;
+  ckpt* c = checkpoint_take();
+  if (ckpt_started) {
+    pthread_mutex_lock(&ckpt_lock);
+    while (ckpt_pending != NULL || ckpt_busy)
+      pthread_cond_wait(&ckpt_cond, &ckpt_lock);
+    ckpt_done = 1;
+    pthread_cond_signal(&ckpt_cond);
+    pthread_mutex_unlock(&ckpt_lock);
+    pthread_join(ckpt_thread, NULL);
+  }
+  ckpt_write(c);
+  free_ckpt(c);
+  printf("Checkpoint written to %s\n", checkpoint_path);
+}
+
+// Restores the run from checkpoint_path if it exists. Called once the
+// metaheuristic has been initialized with the same options as the run
+// that wrote it.
+void checkpoint_resume() {
+  ckpt_last = omp_get_wtime();
+  if (checkpoint_path == NULL)
+    return;
+  FILE* in = fopen(checkpoint_path, "rb");
+  if (in == NULL)
+    return;
+
+  ckpt c = {NULL, 0, 0, 0};
+  char buf[65536];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+    ckpt_put(&c, buf, n);
+  fclose(in);
+
+  char magic[sizeof(CKPT_MAGIC)] = {0};
+  int w, h, threads, modes[3], saved[3];
+  ckpt_get(&c, magic, strlen(CKPT_MAGIC));
+  if (strcmp(magic, CKPT_MAGIC) != 0) {
+    printf("%s is not a checkpoint.\n", checkpoint_path);
+    exit(0);
+  }
+  ckpt_get(&c, &w, sizeof(int));
+  ckpt_get(&c, &h, sizeof(int));
+  ckpt_get(&c, &threads, sizeof(int));
+  ckpt_get(&c, saved, sizeof(saved));
+  if (w != isource->width || h != isource->height) {
+    printf("Checkpoint %s is of a %dx%d image.\n", checkpoint_path, w, h);
+    exit(0);
+  }
+  // -pyramid, -incremental and -hsv must be as they were
+  ckpt_modes(modes);
+  if (memcmp(modes, saved, sizeof(saved)) != 0) {
+    printf("Checkpoint %s was taken with other options.\n", checkpoint_path);
+    exit(0);
+  }
+  if (threads != omp_get_max_threads() && !mh_deterministic)
+    printf("Checkpoint was taken with %d threads; the run won't continue "
+        "exactly as it would have.\n", threads);
+  mh_load(&c);
+  if (c.pos != c.size) {
+    printf("Checkpoint %s was taken with other options.\n", checkpoint_path);
+    exit(0);
+  }
+  free(c.data);
+  printf("Resumed from %s at generation %d\n", checkpoint_path, generation);
+}
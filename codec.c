@@ -0,0 +1,141 @@
+// Kevin Stock
+
+// This file contains reading of PNG and JPEG images and writing of PNG,
+// alongside the ppm functions in image.c. load_image tells the formats
+// apart by their first byte. The decoders hand over one row at a time,
+// and each is decoded straight into its place in the image, whose rows
+// run bottom to top as OpenGL reads them, so no second copy of the image
+// is ever held. Whatever the file holds (grey, a palette, 16 bits,
+// alpha) comes out as 8 bit rgb; alpha is dropped.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <jpeglib.h>
+#include <png.h>
+#include "wiproj.h"
+
+image* codec_image(int w, int h) {
+  if (w <= 0 || h <= 0 || (long)w * h > INT_MAX / 3) {
+    printf("Bad image size %dx%d.\n", w, h);
+    exit(0);
+  }
+  image* ret = checked_malloc(sizeof(image));
+  ret->width = w;
+  ret->height = h;
+  ret->values = checked_malloc((size_t)w * h * 3);
+  return ret;
+}
+
+void codec_png_error(png_structp png, png_const_charp msg) {
+  printf("Corrupt png file: %s.\n", msg);
+  exit(0);
+}
+
+image* load_png(FILE* file) {
+  png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL,
+      codec_png_error, NULL);
+  png_infop info = png_create_info_struct(png);
+  if (png == NULL || info == NULL) {
+    printf("Failed to allocate memory.\n");
+    exit(0);
+  }
+  png_init_io(png, file);
+  png_read_info(png, info);
+
+  // Everything to 8 bit rgb
+  png_set_scale_16(png);
+  png_set_strip_alpha(png);
+  png_set_palette_to_rgb(png);
+  png_set_expand_gray_1_2_4_to_8(png);
+  png_set_gray_to_rgb(png);
+  int passes = png_set_interlace_handling(png);
+  png_read_update_info(png, info);
+
+  int w = png_get_image_width(png, info), h = png_get_image_height(png, info);
+  if (png_get_rowbytes(png, info) != (size_t)w * 3) {
+    printf("Unsupported png file.\n");
+    exit(0);
+  }
+  image* ret = codec_image(w, h);
+  int pass, y;
+  // Later passes of an interlaced image fill in the rows of earlier ones
+  for (pass = 0; pass < passes; pass++)
+    for (y = 0; y < h; y++)
+      png_read_row(png, ret->values + (size_t)(h - 1 - y) * w * 3, NULL);
+  png_read_end(png, NULL);
+  png_destroy_read_struct(&png, &info, NULL);
+  return ret;
+}
+
+void write_png(FILE* file, image* img) {
+  if (file == NULL) return;
+  png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL,
+      codec_png_error, NULL);
+  png_infop info = png_create_info_struct(png);
+  if (png == NULL || info == NULL) {
+    printf("Failed to allocate memory.\n");
+    exit(0);
+  }
+  png_init_io(png, file);
+  png_set_IHDR(png, info, img->width, img->height, 8, PNG_COLOR_TYPE_RGB,
+      PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+  png_write_info(png, info);
+  int y;
+  for (y = img->height - 1; y >= 0; y--)
+    png_write_row(png, img->values + (size_t)y * img->width * 3);
+  png_write_end(png, NULL);
+  png_destroy_write_struct(&png, &info);
+}
+
+void codec_jpeg_error(j_common_ptr cinfo) {
+  char msg[JMSG_LENGTH_MAX];
+  (*cinfo->err->format_message)(cinfo, msg);
+  printf("Corrupt jpeg file: %s.\n", msg);
+  exit(0);
+}
+
+image* load_jpeg(FILE* file) {
+  struct jpeg_decompress_struct cinfo;
+  struct jpeg_error_mgr err;
+  cinfo.err = jpeg_std_error(&err);
+  err.error_exit = codec_jpeg_error;
+  jpeg_create_decompress(&cinfo);
+  jpeg_stdio_src(&cinfo, file);
+  jpeg_read_header(&cinfo, TRUE);
+  cinfo.out_color_space = JCS_RGB;
+  jpeg_start_decompress(&cinfo);
+
+  int w = cinfo.output_width, h = cinfo.output_height;
+  image* ret = codec_image(w, h);
+  while (cinfo.output_scanline < cinfo.output_height) {
+    JSAMPROW row = ret->values + (size_t)(h - 1 - cinfo.output_scanline) * w * 3;
+    jpeg_read_scanlines(&cinfo, &row, 1);
+  }
+  jpeg_finish_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
+  return ret;
+}
+
+// Reads a ppm, PNG or JPEG image. A width of 0 is returned if file is
+// none of them, like load_ppm does.
+image* load_image(FILE* file) {
+  if (file == NULL) return load_ppm(file);
+  int c = getc(file);
+  ungetc(c, file);
+  if (c == 0x89)
+    return load_png(file);
+  if (c == 0xFF)
+    return load_jpeg(file);
+  return load_ppm(file);
+}
+
+// Writes img as a PNG if name ends in .png, and as a ppm otherwise
+void write_image(FILE* file, image* img, const char* name) {
+  size_t n = strlen(name);
+  if (n >= 4 && strcasecmp(name + n - 4, ".png") == 0)
+    write_png(file, img);
+  else
+    write_ppm(file, img);
+}
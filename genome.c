@@ -0,0 +1,181 @@
+// Kevin Stock
+
+// This file contains export of a tri_image's triangles, its genome, which
+// unlike a rendered image can be drawn again at any resolution (see
+// rerender.c), and as SVG.
+//
+// A genome file is a header and the triangles, quantized: each vertex
+// coordinate to 16 bits and each color component to 8, 16 bytes a
+// triangle instead of 40. All numbers are little endian.
+//
+//   "WPG1"                      magic
+//   u32 width, height           of the image the triangles approximate
+//   u32 count                   triangles, in drawing order
+//   u32 flags                   GENOME_ZLIB if the data is compressed
+//   u32 length                  bytes of data that follow
+//   data                        x1 of every triangle, then y1, x2, y2,
+//                               x3, y3 as u16; then r, g, b and a as u8
+//
+// The fields are stored one after another rather than triangle by
+// triangle, which compresses better, though with genome_compress set the
+// data is only kept compressed if that makes it smaller.
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "wiproj.h"
+
+#define GENOME_MAGIC "WPG1"
+#define GENOME_ZLIB 1
+#define GENOME_TRIANGLE_BYTES 16
+
+int genome_compress = 0;
+
+void put_u32(unsigned char* p, unsigned int v) {
+  p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+unsigned int get_u32(unsigned char* p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24;
+}
+
+// f in [0,1] to an integer in [0,max]
+unsigned int quantize(GLfloat f, unsigned int max) {
+  return lrintf(MIN(1.0f, MAX(0.0f, f)) * max);
+}
+
+void write_genome(FILE* file, tri_image* ti) {
+  size_t n = ti->size, i;
+  int f;
+  size_t raw = (size_t)n * GENOME_TRIANGLE_BYTES;
+  unsigned char header[24];
+
+  if (file == NULL) return;
+  unsigned char* data = checked_malloc(MAX(raw, 1));
+  for (i = 0; i < n; i++) {
+    triangle t;
+    get_triangle(ti, i, &t);
+    GLfloat v[10] = {t.x1, t.y1, t.x2, t.y2, t.x3, t.y3, t.r, t.g, t.b, t.a};
+    for (f = 0; f < 6; f++) {
+      unsigned int q = quantize(v[f], 65535);
+      data[(f * n + i) * 2] = q;
+      data[(f * n + i) * 2 + 1] = q >> 8;
+    }
+    for (f = 6; f < 10; f++)
+      data[12 * n + (f - 6) * n + i] = quantize(v[f], 255);
+  }
+
+  unsigned char* out = data;
+  uLongf length = raw;
+  unsigned int flags = 0;
+  if (genome_compress) {
+    length = compressBound(raw);
+    out = checked_malloc(length);
+    if (compress2(out, &length, data, raw, Z_BEST_COMPRESSION) != Z_OK) {
+      printf("Failed to compress the genome.\n");
+      exit(0);
+    }
+    flags |= GENOME_ZLIB;
+    // Well optimized triangles look random, and may not compress at all
+    if (length >= raw) {
+      free(out);
+      out = data;
+      length = raw;
+      flags &= ~GENOME_ZLIB;
+    }
+  }
+
+  memcpy(header, GENOME_MAGIC, 4);
+  put_u32(header + 4, ti->img->width);
+  put_u32(header + 8, ti->img->height);
+  put_u32(header + 12, n);
+  put_u32(header + 16, flags);
+  put_u32(header + 20, length);
+  fwrite(header, 1, sizeof(header), file);
+  fwrite(out, 1, length, file);
+
+  if (out != data)
+    free(out);
+  free(data);
+}
+
+// Reads a genome written by write_genome into a tri_image of the size of
+// the image it was made for
+tri_image* read_genome(FILE* file) {
+  unsigned char header[24];
+  size_t i;
+  int f;
+
+  if (file == NULL || fread(header, 1, sizeof(header), file) < sizeof(header) ||
+      memcmp(header, GENOME_MAGIC, 4) != 0) {
+    printf("Not a genome file.\n");
+    exit(0);
+  }
+  int w = get_u32(header + 4), h = get_u32(header + 8);
+  size_t n = get_u32(header + 12);
+  unsigned int flags = get_u32(header + 16);
+  uLongf length = get_u32(header + 20);
+  uLongf raw = (uLongf)n * GENOME_TRIANGLE_BYTES;
+  // n comes from the file; the data must hold that many triangles, and
+  // they must fit in a tri_image
+  if (w <= 0 || h <= 0 || n > INT_MAX / GENOME_TRIANGLE_BYTES ||
+      (!(flags & GENOME_ZLIB) && length != raw)) {
+    printf("Corrupt genome file.\n");
+    exit(0);
+  }
+
+  unsigned char* in = checked_malloc(MAX(length, 1));
+  if (fread(in, 1, length, file) < length) {
+    printf("Corrupt genome file.\n");
+    exit(0);
+  }
+  unsigned char* data = in;
+  if (flags & GENOME_ZLIB) {
+    uLongf size = raw;
+    data = checked_malloc(MAX(raw, 1));
+    if (uncompress(data, &size, in, length) != Z_OK || size != raw) {
+      printf("Corrupt genome file.\n");
+      exit(0);
+    }
+  }
+
+  tri_image* ti = new_tri_image(n, 0, w, h);
+  for (i = 0; i < n; i++) {
+    GLfloat v[10];
+    for (f = 0; f < 6; f++)
+      v[f] = (data[(f * n + i) * 2] | data[(f * n + i) * 2 + 1] << 8) / 65535.0f;
+    for (f = 6; f < 10; f++)
+      v[f] = data[12 * n + (f - 6) * n + i] / 255.0f;
+    triangle* t = &ti->triangles[i];
+    t->x1 = v[0]; t->y1 = v[1];
+    t->x2 = v[2]; t->y2 = v[3];
+    t->x3 = v[4]; t->y3 = v[5];
+    t->r = v[6]; t->g = v[7]; t->b = v[8]; t->a = v[9];
+  }
+
+  if (data != in)
+    free(data);
+  free(in);
+  return ti;
+}
+
+// Writes ti as an SVG of the size of its image, a polygon per triangle
+// over black like the renderers draw them. SVG's y axis points down.
+void write_svg(FILE* file, tri_image* ti) {
+  int w = ti->img->width, h = ti->img->height, i;
+  if (file == NULL) return;
+  fprintf(file, "<svg xmlns=\"http://www.w3.org/2000/svg\" "
+      "width=\"%d\" height=\"%d\" viewBox=\"0 0 %d %d\">\n", w, h, w, h);
+  fprintf(file, "<rect width=\"%d\" height=\"%d\" fill=\"#000\"/>\n", w, h);
+  for (i = 0; i < ti->size; i++) {
+    triangle t;
+    get_triangle(ti, i, &t);
+    fprintf(file, "<polygon points=\"%.2f,%.2f %.2f,%.2f %.2f,%.2f\" "
+        "fill=\"#%02x%02x%02x\" fill-opacity=\"%.3f\"/>\n",
+        t.x1 * w, (1 - t.y1) * h, t.x2 * w, (1 - t.y2) * h,
+        t.x3 * w, (1 - t.y3) * h,
+        quantize(t.r, 255), quantize(t.g, 255), quantize(t.b, 255), t.a);
+  }
+  fprintf(file, "</svg>\n");
+}
@@ -0,0 +1,152 @@
+// Kevin Stock
+
+// This file contains a spatial index of the triangles of the base of
+// incremental evaluation (see incr.c). The image is split into a grid of
+// GRID_TILE pixel cells, and each cell keeps the set of triangles whose
+// bounding box may reach it, as a bitset indexed by triangle, so reading
+// it back gives them in drawing order. A candidate that differs from the
+// base in a few triangles then only needs those in the cells under its
+// dirty rectangle, plus the ones it changed, set up to re-render it,
+// instead of all of them.
+//
+// When a new base is accepted only the triangles whose cells changed have
+// their bits moved. The base is never read again, so the sets are only
+// valid for candidates derived from the last triangles given to
+// grid_update.
+
+#include "wiproj.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+int grid_cols, grid_rows;
+int grid_w, grid_h;              // size of the image in pixels
+int grid_size = 0;               // triangles indexed
+int grid_words = 0;              // words in the bitset of each cell
+unsigned long* grid_bits = NULL; // the bitsets, one after another
+int* grid_box = NULL;            // cells of each triangle, tx0, ty0, tx1, ty1
+
+void grid_init(int w, int h) {
+  grid_w = w;
+  grid_h = h;
+  grid_cols = (w + GRID_TILE - 1) / GRID_TILE;
+  grid_rows = (h + GRID_TILE - 1) / GRID_TILE;
+  // Allocated by the first grid_update
+  free(grid_bits);
+  grid_bits = NULL;
+  grid_words = grid_size = 0;
+}
+
+// Finds the cells [box[0],box[2]) x [box[1],box[3]) t may cover, with a
+// pixel of slack for vertex snapping
+void grid_cells(triangle* t, int* box) {
+  int x0 = (int)floorf(MIN(t->x1, MIN(t->x2, t->x3)) * grid_w) - 1;
+  int y0 = (int)floorf(MIN(t->y1, MIN(t->y2, t->y3)) * grid_h) - 1;
+  int x1 = (int)ceilf(MAX(t->x1, MAX(t->x2, t->x3)) * grid_w) + 1;
+  int y1 = (int)ceilf(MAX(t->y1, MAX(t->y2, t->y3)) * grid_h) + 1;
+  x0 = MAX(0, x0); y0 = MAX(0, y0);
+  x1 = MIN(grid_w, x1); y1 = MIN(grid_h, y1);
+  if (x0 >= x1 || y0 >= y1) {
+    box[0] = box[1] = box[2] = box[3] = 0;
+    return;
+  }
+  box[0] = x0 / GRID_TILE;
+  box[1] = y0 / GRID_TILE;
+  box[2] = (x1 + GRID_TILE - 1) / GRID_TILE;
+  box[3] = (y1 + GRID_TILE - 1) / GRID_TILE;
+}
+
+// Sets or clears the bit of triangle i in the cells of box
+void grid_mark(int i, int* box, int set) {
+  unsigned long bit = 1UL << (i % 64);
+  int tx, ty;
+  for (ty = box[1]; ty < box[3]; ty++) {
+    unsigned long* w = grid_bits + (ty * grid_cols + box[0]) * grid_words + i / 64;
+    for (tx = box[0]; tx < box[2]; tx++, w += grid_words) {
+      if (set)
+        *w |= bit;
+      else
+        *w &= ~bit;
+    }
+  }
+}
+
+// Indexes the n triangles t in place of the ones indexed before. Only the
+// triangles that moved to other cells, were added or were removed have
+// their bits changed.
+void grid_update(triangle* t, int n) {
+  int i, box[4];
+
+  if (grid_words * 64 < n) {
+    // Start over with room for twice as many
+    grid_words = (2 * n + 63) / 64;
+    free(grid_bits);
+    free(grid_box);
+    grid_bits = checked_malloc(grid_cols * grid_rows * grid_words * sizeof(unsigned long));
+    grid_box = checked_malloc(grid_words * 64 * 4 * sizeof(int));
+    memset(grid_bits, 0, grid_cols * grid_rows * grid_words * sizeof(unsigned long));
+    grid_size = 0;
+  }
+
+  for (i = n; i < grid_size; i++)
+    grid_mark(i, &grid_box[i*4], 0);
+  for (i = 0; i < n; i++) {
+    grid_cells(&t[i], box);
+    if (i < grid_size) {
+      if (memcmp(box, &grid_box[i*4], sizeof(box)) == 0)
+        continue;
+      grid_mark(i, &grid_box[i*4], 0);
+    }
+    grid_mark(i, box, 1);
+    memcpy(&grid_box[i*4], box, sizeof(box));
+  }
+  grid_size = n;
+}
+
+// Lists, in drawing order, the triangles of ti that may cover pixels in
+// [x0,x1) x [y0,y1): the indexed triangles in the cells under the region,
+// and the ones ti changed. ti must be a copy on write of the indexed
+// triangles; NULL is returned if it isn't. The array is reused between
+// calls on the same thread; *n is set to its length.
+int* grid_query(tri_image* ti, int x0, int y0, int x1, int y1, int* n) {
+  static __thread int* list = NULL;
+  static __thread unsigned long* seen = NULL;
+  static __thread int capacity = 0;
+  int words = (ti->size + 63) / 64;
+  int tx0 = x0 / GRID_TILE, ty0 = y0 / GRID_TILE;
+  int tx1 = (x1 + GRID_TILE - 1) / GRID_TILE;
+  int ty1 = (y1 + GRID_TILE - 1) / GRID_TILE;
+  int tx, ty, k;
+
+  if (ti->triangles || ti->size != grid_size)
+    return NULL;
+
+  if (capacity < ti->size) {
+    capacity = ti->size;
+    free(list);
+    free(seen);
+    list = checked_malloc(capacity * sizeof(int));
+    seen = checked_malloc((capacity + 63) / 64 * sizeof(unsigned long));
+  }
+
+  memset(seen, 0, words * sizeof(unsigned long));
+  for (ty = ty0; ty < ty1; ty++) {
+    for (tx = tx0; tx < tx1; tx++) {
+      unsigned long* w = grid_bits + (ty * grid_cols + tx) * grid_words;
+      for (k = 0; k < words; k++)
+        seen[k] |= w[k];
+    }
+  }
+  for (k = 0; k < ti->ndeltas; k++)
+    seen[ti->deltas[k].tri / 64] |= 1UL << (ti->deltas[k].tri % 64);
+
+  *n = 0;
+  for (k = 0; k < words; k++) {
+    unsigned long m = seen[k];
+    while (m) {
+      list[(*n)++] = k * 64 + __builtin_ctzl(m);
+      m &= m - 1;
+    }
+  }
+  return list;
+}
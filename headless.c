@@ -0,0 +1,127 @@
+// Kevin Stock
+
+// This file contains a driver that runs a metaheuristic without a display.
+// It plays the role of start() in renderer.c, but every tri_image is
+// rendered with the software rasterizer in raster.c, so no window, GL
+// context or GPU is needed.
+//
+// Candidates are taken from the metaheuristic in batches of headless_batch
+// (by default one per OpenMP thread) and rendered and evaluated in
+// parallel, then handed back together. With mh_deterministic set the
+// default is DETERMINISTIC_BATCH instead, since the batches a run is cut
+// into change its course, and it must not depend on the thread count.
+//
+// With headless_fused set, tri_images are never rendered to a full image;
+// the metaheuristic scores them with raster_diff instead. That is also how
+// they are scored against a coarser level of the pyramid, which the driver
+// lets mh move down from as the search plateaus.
+//
+// With raster_tiled set, the candidates of a batch are evaluated one after
+// another instead, each rendered and compared on all threads at once, so
+// a single candidate of a very large image takes less time.
+//
+// The loop runs until interrupted or terminated, or until headless_budget
+// candidates have been evaluated or headless_time seconds have passed, if
+// either is set. A checkpoint is taken then and between batches if
+// checkpoint_path is set. The current best is written to headless_output,
+// or to <generation>.ppm in the working directory like the 's' key does,
+// and statistics about the run and the allocation pool are printed.
+// Snapshots are taken along the way as snapshot.c is set to.
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "wiproj.h"
+
+#define DETERMINISTIC_BATCH 8
+
+int headless_fused = 0;
+int headless_batch = 0;
+long headless_budget = 0;     // candidates to evaluate, 0 for no limit
+double headless_time = 0;     // seconds to run for, 0 for no limit
+char* headless_output = NULL; // where to write the best, if not the default
+char* headless_genome = NULL; // where to also write its genome, if anywhere
+char* headless_svg = NULL;    // and an SVG of it
+volatile sig_atomic_t headless_stop = 0;
+
+void headless_interrupt(int sig) {
+  headless_stop = 1;
+}
+
+void save_best(tri_image* ti) {
+  if (ti->img->values == NULL)
+    raster_tri_image(ti);
+  char* name = snapshot_name(ti->generation, "ppm");
+  FILE* out = fopen(headless_output ? headless_output : name, "wb");
+  write_image(out, ti->img, headless_output ? headless_output : name);
+  if (out)
+    fclose(out);
+  free(name);
+  if (headless_genome) {
+    out = fopen(headless_genome, "wb");
+    write_genome(out, ti);
+    if (out)
+      fclose(out);
+  }
+  if (headless_svg) {
+    out = fopen(headless_svg, "w");
+    write_svg(out, ti);
+    if (out)
+      fclose(out);
+  }
+}
+
+void start_headless(
+    int         (*next_batch)(tri_image**, int),
+    tri_image*  (*best)(void),
+    void        (*process_batch)(tri_image**, int)) {
+  signal(SIGINT, headless_interrupt);
+  signal(SIGTERM, headless_interrupt);
+
+  if (headless_batch <= 0)
+    headless_batch = mh_deterministic ? DETERMINISTIC_BATCH : omp_get_max_threads();
+  tri_image** batch = checked_malloc(headless_batch * sizeof(tri_image*));
+  double start = omp_get_wtime();
+  long evaluated = 0;
+
+  while (!headless_stop) {
+    int n = headless_batch;
+    if (headless_budget > 0)
+      n = MIN(n, headless_budget - evaluated);
+    n = next_batch(batch, n);
+    int i;
+    // With raster_tiled, each candidate is spread over the threads instead
+    #pragma omp parallel for schedule(dynamic) if (!raster_tiled)
+    for (i = 0; i < n; i++) {
+      if (batch[i]->state == 0 && !headless_fused)
+        raster_tri_image(batch[i]);
+      evaluate(batch[i]);
+    }
+    process_batch(batch, n);
+    pyr_check(best(), n);
+    checkpoint_tick();
+    snapshot_tick(best());
+    evaluated += n;
+    if (headless_budget > 0 && evaluated >= headless_budget)
+      headless_stop = 1;
+    if (headless_time > 0 && omp_get_wtime() - start >= headless_time)
+      headless_stop = 1;
+  }
+
+  free(batch);
+  checkpoint_finish();
+  snapshot_finish();
+  // ga and ashc have no best until a batch has been processed
+  tri_image* found = best();
+  if (found != NULL)
+    save_best(found);
+  double elapsed = omp_get_wtime() - start;
+  printf("Evaluated %ld candidates in %.1f s (%.0f/s)\n",
+      evaluated, elapsed, evaluated / MAX(elapsed, 1e-9));
+  if (found != NULL)
+    printf("Best: generation %d, %d triangles, error %ld\n",
+        found->generation, found->size, found->error);
+  else
+    printf("Stopped before any candidate was evaluated.\n");
+  pool_print_stats();
+}
@@ -8,110 +8,375 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// Rows handed to writev at a time by write_ppm
+#define PPM_IOV 1024
+
+int diff_metric = METRIC_RGB;
+
+// Downsampled copies of the source, see build_pyramid
+image **pyramid = NULL;
+int pyramid_levels = 0;
+
+// Source HSV planes for METRIC_HSV, see set_metric
+image *hsv_source = NULL;
+float *hsv_planes = NULL;
+
+// Sum of squared differences of n bytes, in plain C
+static long ssd_scalar(GLubyte *a, GLubyte *b, int n) {
+  long ret = 0;
+  int i;
+  for (i=0; i < n; i++) {
+    int val = a[i] - b[i];
+    ret += val * val;
+  }
+  return ret;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// The vector versions widen bytes to 16 bits, subtract, and square and add
+// pairs with madd into 32 bit lanes. A lane gains at most 2 * 255^2 per
+// step, so lanes are flushed to 64 bits every SSD_FLUSH steps.
+#define SSD_FLUSH 4096
 
-void rgb2hsv(float r, float g, float b, float *h, float *s, float *v) {
-  float minVal = MIN(r, MIN(g,b));
-  float maxVal = MAX(r, MAX(g,b));
-  float delta = maxVal - minVal;
-  *v = maxVal;
-  if (delta == 0.0f) {
-    *h = 0.0f;
-    *s = 0.0f;
-  } else {
-    *s = delta / maxVal;
-    float del_R = (((maxVal - r) / 6.0f) + (delta / 2.0f)) / delta;
-    float del_G = (((maxVal - g) / 6.0f) + (delta / 2.0f)) / delta;
-    float del_B = (((maxVal - b) / 6.0f) + (delta / 2.0f)) / delta;
-    if (r == maxVal) {
-      *h = del_B - del_G;
-    } else if (g == maxVal) {
-      *h = (1.0f / 3.0f) + del_R - del_B;
-    } else { // b == maxVal
-      *h = (2.0f / 3.0f) + del_G - del_R;
+__attribute__((target("sse4.1")))
+static long ssd_sse41(GLubyte *a, GLubyte *b, int n) {
+  long ret = 0;
+  int i = 0;
+  while (i + 16 <= n) {
+    __m128i acc = _mm_setzero_si128();
+    int end = MIN(n - 15, i + 16 * SSD_FLUSH);
+    for (; i < end; i += 16) {
+      __m128i va = _mm_loadu_si128((__m128i *)(a + i));
+      __m128i vb = _mm_loadu_si128((__m128i *)(b + i));
+      __m128i lo = _mm_sub_epi16(_mm_cvtepu8_epi16(va), _mm_cvtepu8_epi16(vb));
+      __m128i hi = _mm_sub_epi16(_mm_cvtepu8_epi16(_mm_srli_si128(va, 8)),
+                                 _mm_cvtepu8_epi16(_mm_srli_si128(vb, 8)));
+      acc = _mm_add_epi32(acc, _mm_madd_epi16(lo, lo));
+      acc = _mm_add_epi32(acc, _mm_madd_epi16(hi, hi));
     }
-    if (*h < 0.0f)
-      *h += 1.0f;
-    if (*h > 1.0f)
-      *h -= 1.0f;
+    ret += (unsigned)_mm_extract_epi32(acc, 0) + (unsigned)_mm_extract_epi32(acc, 1)
+         + (unsigned)_mm_extract_epi32(acc, 2) + (unsigned)_mm_extract_epi32(acc, 3);
   }
+  return ret + ssd_scalar(a + i, b + i, n - i);
 }
 
-long image_diff(image *a, image *b) {
+__attribute__((target("avx2")))
+static long ssd_avx2(GLubyte *a, GLubyte *b, int n) {
   long ret = 0;
   int i = 0;
+  while (i + 32 <= n) {
+    __m256i acc = _mm256_setzero_si256();
+    int end = MIN(n - 31, i + 32 * SSD_FLUSH);
+    for (; i < end; i += 32) {
+      __m256i va = _mm256_loadu_si256((__m256i *)(a + i));
+      __m256i vb = _mm256_loadu_si256((__m256i *)(b + i));
+      __m256i lo = _mm256_sub_epi16(
+          _mm256_cvtepu8_epi16(_mm256_castsi256_si128(va)),
+          _mm256_cvtepu8_epi16(_mm256_castsi256_si128(vb)));
+      __m256i hi = _mm256_sub_epi16(
+          _mm256_cvtepu8_epi16(_mm256_extracti128_si256(va, 1)),
+          _mm256_cvtepu8_epi16(_mm256_extracti128_si256(vb, 1)));
+      acc = _mm256_add_epi32(acc, _mm256_madd_epi16(lo, lo));
+      acc = _mm256_add_epi32(acc, _mm256_madd_epi16(hi, hi));
+    }
+    // Widen the lanes to 64 bits before adding them up
+    __m256i wide = _mm256_add_epi64(
+        _mm256_cvtepu32_epi64(_mm256_castsi256_si128(acc)),
+        _mm256_cvtepu32_epi64(_mm256_extracti128_si256(acc, 1)));
+    ret += _mm256_extract_epi64(wide, 0) + _mm256_extract_epi64(wide, 1)
+         + _mm256_extract_epi64(wide, 2) + _mm256_extract_epi64(wide, 3);
+  }
+  return ret + ssd_scalar(a + i, b + i, n - i);
+}
+#endif
+
+// Converts n pixels to hue, saturation and value planes. This is the usual
+// conversion, with the tests on which channel is largest done as selects.
+static inline __attribute__((always_inline))
+void hsv_kernel(GLubyte *rgb, float *h, float *s, float *v, int n) {
+  int i;
+  #pragma omp simd
+  for (i=0; i < n; i++) {
+    float r = rgb[3*i] / 255.0f;
+    float g = rgb[3*i+1] / 255.0f;
+    float b = rgb[3*i+2] / 255.0f;
+    float maxVal = MAX(r, MAX(g,b));
+    float delta = maxVal - MIN(r, MIN(g,b));
+    // Every value is computed unconditionally and then selected from, which
+    // (with -fno-trapping-math) lets this vectorize. Divisions are by 1
+    // where unused.
+    float gb = g - b, br = b - r, rg = r - g;
+    float num = r == maxVal ? gb : g == maxVal ? br : rg;
+    float base = r == maxVal ? 0.0f : g == maxVal ? 1.0f / 3.0f : 2.0f / 3.0f;
+    float hue = base + num / (6.0f * (delta == 0.0f ? 1.0f : delta));
+    float sat = delta / (maxVal == 0.0f ? 1.0f : maxVal);
+    float up = hue + 1.0f, down = hue - 1.0f;
+    hue = hue < 0.0f ? up : hue;
+    hue = hue > 1.0f ? down : hue;
+    h[i] = delta == 0.0f ? 0.0f : hue;
+    s[i] = delta == 0.0f ? 0.0f : sat;
+    v[i] = maxVal;
+  }
+}
+
+// Weighted sum of squares of differences in h s v channels between n
+// pixels and precomputed planes. Each pixel's difference is truncated to an
+// integer so sums don't depend on how the image was split up.
+static inline __attribute__((always_inline))
+long hsv_diff_kernel(GLubyte *a, float *bh, float *bs, float *bv, int n) {
+  float ah[HSV_CHUNK], as[HSV_CHUNK], av[HSV_CHUNK];
+  float hw = 1000, sw = 1000, vw = 1000;
+  long ret = 0;
+  int i, j;
+  for (i=0; i < n; i += HSV_CHUNK) {
+    int m = MIN(HSV_CHUNK, n - i);
+    int sum = 0;
+    hsv_kernel(a + 3*i, ah, as, av, m);
+    #pragma omp simd reduction(+:sum)
+    for (j=0; j < m; j++) {
+      float dh = ah[j] - bh[i+j], ds = as[j] - bs[i+j], dv = av[j] - bv[i+j];
+      sum += (int)(hw*dh*dh + sw*ds*ds + vw*dv*dv);
+    }
+    ret += sum;
+  }
+  return ret;
+}
+
+static void hsv_scalar(GLubyte *rgb, float *h, float *s, float *v, int n) {
+  hsv_kernel(rgb, h, s, v, n);
+}
+
+static long hsv_diff_scalar(GLubyte *a, float *bh, float *bs, float *bv, int n) {
+  return hsv_diff_kernel(a, bh, bs, bv, n);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static void hsv_avx2(GLubyte *rgb, float *h, float *s, float *v, int n) {
+  hsv_kernel(rgb, h, s, v, n);
+}
+
+__attribute__((target("avx2")))
+static long hsv_diff_avx2(GLubyte *a, float *bh, float *bs, float *bv, int n) {
+  return hsv_diff_kernel(a, bh, bs, bv, n);
+}
+#endif
+
+static long ssd_select(GLubyte *a, GLubyte *b, int n);
+static void hsv_select(GLubyte *rgb, float *h, float *s, float *v, int n);
+static long hsv_diff_select(GLubyte *a, float *bh, float *bs, float *bv, int n);
+
+// Sum of squared differences of n bytes, conversion of n pixels to hsv
+// planes, and hsv difference of n pixels against planes, using the widest
+// vector instructions the cpu supports. Picked on the first call.
+static long (*ssd)(GLubyte *a, GLubyte *b, int n) = ssd_select;
+static void (*hsv)(GLubyte *rgb, float *h, float *s, float *v, int n) = hsv_select;
+static long (*hsv_diff)(GLubyte *a, float *bh, float *bs, float *bv, int n) = hsv_diff_select;
+
+static void pick_kernels() {
+  long (*pick_ssd)(GLubyte *a, GLubyte *b, int n) = ssd_scalar;
+  void (*pick_hsv)(GLubyte *rgb, float *h, float *s, float *v, int n) = hsv_scalar;
+  long (*pick_hsv_diff)(GLubyte *a, float *bh, float *bs, float *bv, int n) = hsv_diff_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    pick_ssd = ssd_avx2;
+    pick_hsv = hsv_avx2;
+    pick_hsv_diff = hsv_diff_avx2;
+  } else if (__builtin_cpu_supports("sse4.1")) {
+    pick_ssd = ssd_sse41;
+  }
+#endif
+  ssd = pick_ssd;
+  hsv = pick_hsv;
+  hsv_diff = pick_hsv_diff;
+}
+
+static long ssd_select(GLubyte *a, GLubyte *b, int n) {
+  pick_kernels();
+  return ssd(a, b, n);
+}
+
+static void hsv_select(GLubyte *rgb, float *h, float *s, float *v, int n) {
+  pick_kernels();
+  hsv(rgb, h, s, v, n);
+}
+
+static long hsv_diff_select(GLubyte *a, float *bh, float *bs, float *bv, int n) {
+  pick_kernels();
+  return hsv_diff(a, bh, bs, bv, n);
+}
+
+void set_metric(int metric, image *source) {
+  diff_metric = metric;
+  if (metric == METRIC_HSV && hsv_source != source) {
+    int n = source->width * source->height;
+    free(hsv_planes);
+    hsv_planes = checked_malloc(3*n*sizeof(float));
+    hsv(source->values, hsv_planes, hsv_planes + n, hsv_planes + 2*n, n);
+    hsv_source = source;
+  }
+}
+
+// Difference of the n pixels at a and the n pixels of b starting at pixel p
+static long span_diff(GLubyte *a, image *b, int p, int n) {
+  if (diff_metric == METRIC_RGB) {
+    // Sum of squares of difference in r g b channels
+    return ssd(a, b->values + 3*p, 3*n);
+  }
+
+  int size = b->width * b->height;
+  if (b == hsv_source) {
+    return hsv_diff(a, hsv_planes + p, hsv_planes + size + p, hsv_planes + 2*size + p, n);
+  }
+
+  // Not the source, convert b as we go
+  float bh[HSV_CHUNK], bs[HSV_CHUNK], bv[HSV_CHUNK];
+  long ret = 0;
+  int i;
+  for (i=0; i < n; i += HSV_CHUNK) {
+    int m = MIN(HSV_CHUNK, n - i);
+    hsv(b->values + 3*(p+i), bh, bs, bv, m);
+    ret += hsv_diff(a + 3*i, bh, bs, bv, m);
+  }
+  return ret;
+}
+
+long image_diff(image *a, image *b) {
+  long ret = 0;
+  int j = 0;
 
   if (a->width != b->width || a->height != b->height) {
     printf("Image diff of different sized images attempted.\n");
     exit(0);
   }
 
-  #pragma omp parallel for reduction(+:ret)
-  for (i=0; i < a->width * a->height; i++) {
-    int ar, ag, ab, br, bg, bb;
-    ar = (a->values)[3*i];
-    ag = (a->values)[3*i+1];
-    ab = (a->values)[3*i+2];
-    br = (b->values)[3*i];
-    bg = (b->values)[3*i+1];
-    bb = (b->values)[3*i+2];
-    // Sum of squares of difference in r g b channels
-#if RGB_COMP
-    int val;
-    val = ar - br;
-    ret += val * val;
-    val = ag - bg;
-    ret += val * val;
-    val = ab - bb;
-    ret += val * val;
-#else
-    // Sum of squares of differences in h s v channels
-    float ah, as, av, bh, bs, bv;
-    float hw = 1000, sw = 1000, vw = 1000;
-    rgb2hsv(ar/255.0f, ag/255.0f, ab/255.0f, &ah, &as, &av);
-    rgb2hsv(br/255.0f, bg/255.0f, bb/255.0f, &bh, &bs, &bv);
-    ret += hw*(ah-bh)*(ah-bh);
-    ret += sw*(as-bs)*(as-bs);
-    ret += vw*(av-bv)*(av-bv);
-#endif
+  // Small images are faster on one thread than starting a team
+  int row = a->width * 3;
+  #pragma omp parallel for reduction(+:ret) if (a->width * a->height >= DIFF_PARALLEL_MIN)
+  for (j=0; j < a->height; j++) {
+    ret += span_diff(a->values + j*row, b, j*a->width, a->width);
   }
 
   return ret;
 }
 
-void flip_image(image* img) {
-  int i, j;
-  GLubyte t;
-  for (i = 0; i < img->height / 2; i++) {
-    int first = i * img->width * 3;
-    int second = (img->height - i - 1) * img->width * 3;
-    for (j = 0; j < img->width * 3; j++) {
-      t = (img->values)[first+j];
-      (img->values)[first+j] = (img->values)[second+j];
-      (img->values)[second+j] = t;
-    }
+// Difference between a w x h block of pixels, with rows stride bytes apart,
+// and the block of b whose lower left pixel is (x,y)
+long region_diff(GLubyte *a, int stride, image *b, int x, int y, int w, int h) {
+  long ret = 0;
+  int j;
+  for (j=0; j < h; j++) {
+    ret += span_diff(a + j*stride, b, (y+j)*b->width + x, w);
   }
+  return ret;
 }
 
-int get_int(FILE *file) {
-  int x = 0;
-  int val;
+void image_alloc(image *img) {
+  if (img->values) return;
+  img->values = pool_alloc(img->width*img->height*3*sizeof(GLubyte));
+}
 
-  while (!isdigit(val = getc(file))) {
-    if (val == '#') {
-      while ((val = getc(file)) != '\n') {
-        if (val == EOF) return 0;
+// Halves img in each dimension, averaging blocks of 2x2 pixels. A row or
+// column left over from an odd size is dropped.
+image* half_image(image *img) {
+  image *ret = checked_malloc(sizeof(image));
+  int i, j, c;
+  ret->width = img->width / 2;
+  ret->height = img->height / 2;
+  ret->values = checked_malloc(ret->width*ret->height*3*sizeof(GLubyte));
+  for (j = 0; j < ret->height; j++) {
+    GLubyte *a = img->values + 2*j*img->width*3;
+    GLubyte *b = a + img->width*3;
+    GLubyte *out = ret->values + j*ret->width*3;
+    for (i = 0; i < ret->width; i++) {
+      for (c = 0; c < 3; c++) {
+        out[3*i+c] = (a[6*i+c] + a[6*i+3+c] + b[6*i+c] + b[6*i+3+c] + 2) / 4;
       }
     }
-    if (val == EOF) return 0;
   }
+  return ret;
+}
 
-  do {
-    x = x*10 + (val - '0');
-  } while (isdigit(val = getc(file))); 
+// Builds pyramid[0] = source, with each level half the size of the one
+// before, down to PYRAMID_MIN pixels on the shorter side
+void build_pyramid(image *source) {
+  int levels = 1;
+  while (MIN(source->width, source->height) >> levels >= PYRAMID_MIN &&
+      levels < PYRAMID_MAX_LEVELS)
+    levels++;
 
+  pyramid = checked_malloc(levels * sizeof(image*));
+  pyramid[0] = source;
+  for (pyramid_levels = 1; pyramid_levels < levels; pyramid_levels++)
+    pyramid[pyramid_levels] = half_image(pyramid[pyramid_levels-1]);
+}
+
+// Parses the next decimal number in p[*pos..size), skipping whitespace and
+// comments. Returns -1 if there is none.
+long ppm_int(GLubyte* p, size_t size, size_t* pos) {
+  long x = 0;
+  while (*pos < size && !isdigit(p[*pos])) {
+    if (p[*pos] == '#') {
+      while (*pos < size && p[*pos] != '\n')
+        (*pos)++;
+    } else if (!isspace(p[*pos])) {
+      return -1;
+    }
+    if (*pos < size)
+      (*pos)++;
+  }
+  if (*pos >= size)
+    return -1;
+  while (*pos < size && isdigit(p[*pos]) && x < 1L << 32)
+    x = x*10 + (p[(*pos)++] - '0');
   return x;
 }
 
+// The whole of file, mapped if it is a regular file or read otherwise.
+// *mapped is set if it has to be unmapped rather than freed.
+GLubyte* ppm_contents(FILE* file, size_t* size, int* mapped) {
+  struct stat st;
+  int fd = fileno(file);
+  *mapped = 0;
+  if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p != MAP_FAILED) {
+      madvise(p, st.st_size, MADV_SEQUENTIAL);
+      *size = st.st_size;
+      *mapped = 1;
+      return p;
+    }
+  }
+
+  size_t capacity = 1 << 20, n;
+  GLubyte* p = malloc(capacity);
+  *size = 0;
+  while (p && (n = fread(p + *size, 1, capacity - *size, file)) > 0) {
+    *size += n;
+    if (*size == capacity)
+      p = realloc(p, capacity *= 2);
+  }
+  if (p == NULL) {
+    printf("Failed to allocate memory.\n");
+    exit(0);
+  }
+  return p;
+}
+
+// Reads a P3, P5 or P6 ppm with a maxval of up to 65535 into an rgb image
+// with 8 bits a sample and its rows bottom to top, as OpenGL reads them.
+// Each row is converted straight into its flipped place. A width of 0 is
+// returned if file isn't a ppm.
 image* load_ppm(FILE *file) {
   image *bad = malloc(sizeof(image));
   image *ret = malloc(sizeof(image));
@@ -120,38 +385,111 @@ image* load_ppm(FILE *file) {
   bad->values = NULL;
 
   if (file==NULL) return bad;
-  if (getc(file) != 'P') return bad;
-  if (getc(file) != '6') return bad;
-
-  ret->width = get_int(file);
-  ret->height = get_int(file);
-  if (get_int(file) != 255) return bad;
-
-  ret->values = malloc(ret->width*ret->height*3*sizeof(GLubyte));
-  if (ret->values == NULL) {
-    printf("Failed to allocate memory.\n");
-    exit(0);
+  size_t size, pos = 2;
+  int mapped;
+  GLubyte* p = ppm_contents(file, &size, &mapped);
+  char type = size >= 2 && p[0] == 'P' ? p[1] : 0;
+  long w = ppm_int(p, size, &pos);
+  long h = ppm_int(p, size, &pos);
+  long maxval = ppm_int(p, size, &pos);
+  if ((type != '3' && type != '5' && type != '6') ||
+      w <= 0 || h <= 0 || w * h > INT_MAX / 3 || maxval <= 0 || maxval > 65535) {
+    if (mapped) munmap(p, size); else free(p);
+    return bad;
   }
-  if (fread(ret->values,1, ret->width*ret->height*3, file) < ret->width*ret->height*3) {
+  pos++; // the single whitespace before binary samples
+
+  int channels = type == '5' ? 1 : 3;
+  int depth = maxval > 255 ? 2 : 1;
+  long row = w * channels * depth;
+  if (type != '3' && (pos > size || (size - pos) / row < h)) {
     printf("Corrupt ppm file.\n");
     exit(0);
   }
 
-  flip_image(ret);
+  ret->width = w;
+  ret->height = h;
+  ret->values = checked_malloc(w*h*3*sizeof(GLubyte));
+  // Samples scaled to 8 bits, unless they already are
+  GLubyte* scale = maxval == 255 ? NULL : checked_malloc(maxval + 1);
+  long i, x, y;
+  for (i = 0; scale && i <= maxval; i++)
+    scale[i] = (i * 255 + maxval / 2) / maxval;
+
+  for (y = 0; y < h; y++) {
+    GLubyte* out = ret->values + (h - 1 - y) * w * 3;
+    GLubyte* in = type == '3' ? NULL : p + pos + y * row;
+    if (type == '6' && maxval == 255) {
+      memcpy(out, in, w * 3);
+      continue;
+    }
+    for (x = 0; x < w * channels; x++) {
+      long v;
+      if (type == '3') {
+        if ((v = ppm_int(p, size, &pos)) < 0) {
+          printf("Corrupt ppm file.\n");
+          exit(0);
+        }
+      } else {
+        v = depth == 2 ? in[2*x] << 8 | in[2*x+1] : in[x];
+      }
+      v = scale ? scale[MIN(v, maxval)] : MIN(v, 255);
+      if (channels == 1) {
+        out[3*x] = out[3*x+1] = out[3*x+2] = v;
+      } else {
+        out[x] = v;
+      }
+    }
+  }
 
+  free(scale);
+  if (mapped) munmap(p, size); else free(p);
   free(bad);
   return ret;
 }
 
+// Writes img as a P6 ppm. The rows are written top to bottom straight from
+// img, which is left untouched, with as few writes as the system allows.
 void write_ppm(FILE *file, image *img) {
-  flip_image(img);
   if (file == NULL) return;
-  fprintf(file, "P6 %d %d 255\n",img->width, img->height);
-  int i;
-  for (i=0;i < img->width*img->height*3; i++) {
-    fprintf(file, "%c",(img->values)[i]);
+  char header[64];
+  int n = snprintf(header, sizeof(header), "P6 %d %d 255\n", img->width, img->height);
+  int rows = img->height, stride = img->width * 3, y = 0;
+
+  fflush(file);
+  int fd = fileno(file);
+  if (fd < 0) {
+    fwrite(header, 1, n, file);
+    for (y = rows - 1; y >= 0; y--)
+      fwrite(img->values + (size_t)y * stride, 1, stride, file);
+    return;
+  }
+
+  struct iovec iov[PPM_IOV];
+  int k = 0;
+  iov[k].iov_base = header;
+  iov[k++].iov_len = n;
+  while (k > 0 || y < rows) {
+    for (; k < PPM_IOV && y < rows; k++, y++) {
+      iov[k].iov_base = img->values + (size_t)(rows - 1 - y) * stride;
+      iov[k].iov_len = stride;
+    }
+    ssize_t done = writev(fd, iov, k);
+    if (done < 0) {
+      printf("Failed to write ppm file.\n");
+      return;
+    }
+    // Drop what was written, keeping the rest of a partly written row
+    int j = 0;
+    while (j < k && done >= (ssize_t)iov[j].iov_len)
+      done -= iov[j++].iov_len;
+    if (j < k) {
+      iov[j].iov_base = (char*)iov[j].iov_base + done;
+      iov[j].iov_len -= done;
+    }
+    memmove(iov, iov + j, (k - j) * sizeof(struct iovec));
+    k -= j;
   }
-  flip_image(img);
 }
 
 /*
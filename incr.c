@@ -0,0 +1,252 @@
+// Kevin Stock
+
+// This file contains incremental evaluation of tri_images that differ from
+// the current best (the base) in only a few triangles. The base's error per
+// tile is kept, so a candidate derived from it only needs the tiles under its
+// dirty rectangle re-rendered, with all its triangles in order so blending
+// is unchanged, and compared; its error is the base's error adjusted by the
+// change in those tiles.
+//
+// Rows of dirty tiles are scored in decreasing order of the base's error,
+// and scoring stops once the candidate's error is sure to reach its bound,
+// assuming the rows left could at best drop to no error at all.
+//
+// The new tile errors are kept with the candidate as a patch. If the
+// metaheuristic accepts the candidate, inc_accept applies the patch to make
+// it the new base. The base's pixels are never needed: blending can't be
+// undone, so dirty tiles are always composited again from black.
+//
+// Only the triangles the spatial index in grid.c lists under the dirty
+// tiles are set up to render them.
+//
+// The tile errors double as a map of where the base is furthest from the
+// source, which inc_pick samples so mutations can target those areas.
+
+#include "wiproj.h"
+#include <math.h>
+#include <stdlib.h>
+
+struct _patch {
+  int serial;             // inc_serial of the base this was computed against
+  int tx0, ty0, tx1, ty1; // tiles [tx0,tx1) x [ty0,ty1)
+  long* error;            // error of each tile, row major
+};
+
+int inc_enabled = 0;
+
+image* inc_source;
+int inc_cols, inc_rows;
+tri_image* inc_owner = NULL; // tri_image the base was rendered from
+int inc_serial = 0;          // changes every time the base does
+long* inc_error;             // error of each tile of the base
+long* inc_cdf;               // running sums of inc_error, for inc_pick
+
+void inc_init(image* source) {
+  inc_source = source;
+  inc_cols = (source->width + INC_TILE - 1) / INC_TILE;
+  inc_rows = (source->height + INC_TILE - 1) / INC_TILE;
+  inc_error = checked_malloc(inc_cols * inc_rows * sizeof(long));
+  inc_cdf = checked_malloc(inc_cols * inc_rows * sizeof(long));
+  inc_owner = NULL;
+  inc_enabled = 1;
+  grid_init(source->width, source->height);
+}
+
+void free_patch(patch* p) {
+  if (p) {
+    pool_free(p->error);
+    pool_free(p);
+  }
+}
+
+// Renders the tiles [tx0,tx1) x [ty0,ty1) of ti and stores each tile's
+// error in error
+void inc_render(tri_image* ti, long* error, int tx0, int ty0, int tx1, int ty1) {
+  static __thread GLubyte* out = NULL;
+  static __thread int out_size = 0;
+  int w = inc_source->width, h = inc_source->height;
+  int x0 = tx0 * INC_TILE, y0 = ty0 * INC_TILE;
+  int x1 = MIN(tx1 * INC_TILE, w), y1 = MIN(ty1 * INC_TILE, h);
+  int stride = (x1 - x0) * 3;
+  int tx, ty;
+
+  if (out_size < stride * (y1 - y0)) {
+    out_size = stride * (y1 - y0);
+    free(out);
+    out = checked_malloc(out_size);
+  }
+
+  raster_region(ti, out, stride, x0, y0, x1, y1);
+  for (ty = ty0; ty < ty1; ty++) {
+    for (tx = tx0; tx < tx1; tx++) {
+      int x = tx * INC_TILE, y = ty * INC_TILE;
+      *error++ = region_diff(out + (y - y0) * stride + (x - x0) * 3, stride,
+          inc_source, x, y, MIN(INC_TILE, w - x), MIN(INC_TILE, h - y));
+    }
+  }
+}
+
+// Computes ti->error from the base if ti was derived from it. Returns 0,
+// leaving ti untouched, if it can't be.
+int inc_evaluate(tri_image* ti) {
+  static __thread GLubyte* out = NULL;
+  static __thread int out_size = 0;
+  static __thread long* base = NULL;
+  static __thread int* order = NULL;
+  static __thread int capacity = 0;
+
+  if (!inc_enabled || ti->parent == NULL || ti->parent != inc_owner)
+    return 0;
+
+  int w = inc_source->width, h = inc_source->height;
+  if (ti->dirty[0] > ti->dirty[2]) {
+    // Nothing moved
+    ti->error = inc_owner->error;
+    return 1;
+  }
+
+  // Pixels whose centers may be covered by the dirty rectangle, with a
+  // pixel of slack for vertex snapping
+  int x0 = MAX(0, (int)floorf(ti->dirty[0] * w) - 1);
+  int y0 = MAX(0, (int)floorf(ti->dirty[1] * h) - 1);
+  int x1 = MIN(w, (int)ceilf(ti->dirty[2] * w) + 1);
+  int y1 = MIN(h, (int)ceilf(ti->dirty[3] * h) + 1);
+  if (x0 >= x1 || y0 >= y1) {
+    ti->error = inc_owner->error;
+    return 1;
+  }
+
+  patch* p = pool_alloc(sizeof(patch));
+  p->serial = inc_serial;
+  p->tx0 = x0 / INC_TILE;
+  p->ty0 = y0 / INC_TILE;
+  p->tx1 = (x1 + INC_TILE - 1) / INC_TILE;
+  p->ty1 = (y1 + INC_TILE - 1) / INC_TILE;
+  int cols = p->tx1 - p->tx0, rows = p->ty1 - p->ty0;
+  int x0t = p->tx0 * INC_TILE, x1t = MIN(p->tx1 * INC_TILE, w);
+  int stride = (x1t - x0t) * 3;
+  p->error = pool_alloc(cols * rows * sizeof(long));
+
+  if (capacity < rows) {
+    capacity = rows;
+    free(base);
+    free(order);
+    base = checked_malloc(capacity * sizeof(long));
+    order = checked_malloc(capacity * sizeof(int));
+  }
+  if (out_size < stride * INC_TILE) {
+    out_size = stride * INC_TILE;
+    free(out);
+    out = checked_malloc(out_size);
+  }
+  // What the base's dirty rows of tiles contribute, which the candidate's
+  // could at best bring down to 0
+  long left = 0;
+  int tx, ty, k;
+  for (ty = 0; ty < rows; ty++) {
+    base[ty] = 0;
+    for (tx = p->tx0; tx < p->tx1; tx++)
+      base[ty] += inc_error[(p->ty0 + ty) * inc_cols + tx];
+    left += base[ty];
+  }
+  order_by_error(base, rows, order);
+
+  long delta = 0;
+  int y0t = p->ty0 * INC_TILE, y1t = MIN(p->ty1 * INC_TILE, h);
+  int nlist;
+  int* list = grid_query(ti, x0t, y0t, x1t, y1t, &nlist);
+  if (list)
+    raster_prepare_list(ti, list, nlist, x0t, y0t, x1t, y1t);
+  else
+    raster_prepare(ti, x0t, y0t, x1t, y1t);
+  for (k = 0; k < rows; k++) {
+    ty = order[k];
+    int y = (p->ty0 + ty) * INC_TILE, th = MIN(INC_TILE, h - y);
+    raster_prepared(out, stride, x0t, y, x1t, y + th);
+    for (tx = 0; tx < cols; tx++) {
+      int x = x0t + tx * INC_TILE;
+      long e = region_diff(out + tx * INC_TILE * 3, stride, inc_source,
+          x, y, MIN(INC_TILE, w - x), th);
+      p->error[ty * cols + tx] = e;
+      delta += e;
+    }
+    delta -= base[ty];
+    left -= base[ty];
+    if (inc_owner->error + delta - left >= ti->bound) {
+      // Rejected whatever the rest hold; the patch is incomplete
+      free_patch(p);
+      free_patch(ti->patch);
+      ti->patch = NULL;
+      ti->error = inc_owner->error + delta - left;
+      return 1;
+    }
+  }
+
+  free_patch(ti->patch);
+  ti->patch = p;
+  ti->error = inc_owner->error + delta;
+  return 1;
+}
+
+// Makes ti, which must have been evaluated, the base for following
+// candidates
+void inc_accept(tri_image* ti) {
+  patch* p = ti->patch;
+
+  if (!inc_enabled || ti == inc_owner)
+    return;
+
+  if (p && p->serial == inc_serial) {
+    int k = 0, tx, ty;
+    for (ty = p->ty0; ty < p->ty1; ty++)
+      for (tx = p->tx0; tx < p->tx1; tx++)
+        inc_error[ty * inc_cols + tx] = p->error[k++];
+  } else {
+    int k;
+    inc_render(ti, inc_error, 0, 0, inc_cols, inc_rows);
+    // Keep the error consistent with the tiles later candidates adjust
+    ti->error = 0;
+    for (k = 0; k < inc_cols * inc_rows; k++)
+      ti->error += inc_error[k];
+  }
+
+  free_patch(ti->patch);
+  ti->patch = NULL;
+  inc_owner = ti;
+  inc_serial++;
+  grid_update(ti->triangles, ti->size);
+
+  long sum = 0;
+  int k;
+  for (k = 0; k < inc_cols * inc_rows; k++)
+    inc_cdf[k] = sum += inc_error[k];
+}
+
+// Maps u in [0,1) to a tile, each tile taking a share of [0,1) in
+// proportion to its error in the base. Returns -1 if no base has been
+// accepted yet or it matches the source exactly.
+int inc_pick(double u) {
+  int n = inc_cols * inc_rows;
+  if (!inc_enabled || inc_serial == 0 || inc_cdf[n-1] == 0)
+    return -1;
+  long v = (long)(u * inc_cdf[n-1]);
+  int lo = 0, hi = n - 1;
+  // The first tile whose running sum exceeds v
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (inc_cdf[mid] > v)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  return lo;
+}
+
+// Called when ti is freed
+void inc_release(tri_image* ti) {
+  free_patch(ti->patch);
+  ti->patch = NULL;
+  // The base's tile errors stay valid for patches computed against it
+  if (ti == inc_owner)
+    inc_owner = NULL;
+}
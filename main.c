@@ -1,29 +1,186 @@
 // Kevin Stock
 
-// This just a basic main for starting the program. In the future it may parse
-// commandline options for setting up everything, but at the moment it simply
-// requires hardcoding the desired options.
+// This is the main for starting the program. It loads the image, picks a
+// metaheuristic and its parameters from the command line, and hands it to
+// one of the drivers: the GLUT window in renderer.c, the offscreen OpenGL
+// loop in offscreen.c, or the software rasterizer in headless.c.
 
 #include "wiproj.h"
+#include <stdlib.h>
+#include <string.h>
+
+// The entry points of a metaheuristic
+typedef struct _mh_funcs {
+  const char* name;
+  tri_image*  (*next)(void);
+  tri_image*  (*best)(void);
+  void        (*process)(tri_image*);
+  int         (*next_batch)(tri_image**, int);
+  void        (*process_batch)(tri_image**, int);
+} mh_funcs;
+
+mh_funcs mhs[] = {
+  {"shc", shc_next, shc_best, shc_process, shc_next_batch, shc_process_batch},
+  {"ashc", ashc_next, ashc_best, ashc_process, ashc_next_batch, ashc_process_batch},
+  {"sa", sa_next, sa_best, sa_process, sa_next_batch, sa_process_batch},
+  {"acc", acc_next, acc_best, acc_process, acc_next_batch, acc_process_batch},
+  {"ga", ga_next, ga_best, ga_process, ga_next_batch, ga_process_batch},
+};
+
+void usage() {
+  printf("First argument should be a .ppm, .png or .jpg image, optionally followed by\n"
+      "  -headless, -fused, -incremental, -targeted, -pyramid, -tiled,\n"
+      "  -offscreen, -preview, -hsv, -deterministic or -compress, and\n"
+      "  -alg shc|ashc|sa|acc|ga  metaheuristic (acc)\n"
+      "  -triangles N             triangles, the most for acc (1000)\n"
+      "  -population N            population for ga (110)\n"
+      "  -budget N                candidates to evaluate (headless)\n"
+      "  -time S                  seconds to run for (headless)\n"
+      "  -threads N               OpenMP threads\n"
+      "  -batch N                 candidates per batch (headless)\n"
+      "  -seed N                  random seed (from the clock)\n"
+      "  -out FILE                where to write the best, .png or .ppm\n"
+      "  -genome FILE             also write its triangles, see rerender\n"
+      "  -svg FILE                and an SVG of them\n"
+      "  -snapshot-every S        write the best every S seconds\n"
+      "  -snapshot-gain F         and whenever its error falls by a fraction F\n"
+      "  -snapshot-prefix P       to P<generation>.ppm\n"
+      "  -checkpoint FILE         resume from and save the run to FILE\n"
+      "  -checkpoint-every S      seconds between checkpoints (300)\n");
+}
+
+// The value following the option argv[*i], which is skipped
+char* option_value(int argc, char** argv, int* i) {
+  if (*i + 1 >= argc) {
+    printf("%s needs a value.\n", argv[*i]);
+    exit(0);
+  }
+  return argv[++*i];
+}
 
 int main(int argc, char** argv) {
   if (argc < 2) {
-    printf("First and only argument should be a .ppm file (P6)\n");
+    usage();
     return 0;
   }
-  FILE* input = fopen(argv[1],"r");
-  image* source = load_ppm(input);
+  int headless = 0, offscreen = 0, hsv = 0, pyr = 0, i;
+  int triangles = 1000, population = 110;
+  char* alg = "acc";
+  for (i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "-headless") == 0)
+      headless = 1;
+    else if (strcmp(argv[i], "-fused") == 0)
+      headless = headless_fused = 1;
+    else if (strcmp(argv[i], "-incremental") == 0)
+      headless = headless_fused = inc_enabled = 1;
+    else if (strcmp(argv[i], "-targeted") == 0)
+      headless = headless_fused = inc_enabled = mh_targeted = 1;
+    else if (strcmp(argv[i], "-pyramid") == 0)
+      headless = headless_fused = pyr = 1;
+    else if (strcmp(argv[i], "-tiled") == 0)
+      headless = raster_tiled = 1;
+    else if (strcmp(argv[i], "-offscreen") == 0)
+      offscreen = 1;
+    else if (strcmp(argv[i], "-preview") == 0)
+      offscreen = offscreen_preview = 1;
+    else if (strcmp(argv[i], "-hsv") == 0)
+      hsv = 1;
+    else if (strcmp(argv[i], "-deterministic") == 0)
+      mh_deterministic = 1;
+    else if (strcmp(argv[i], "-compress") == 0)
+      genome_compress = 1;
+    else if (strcmp(argv[i], "-alg") == 0)
+      alg = option_value(argc, argv, &i);
+    else if (strcmp(argv[i], "-triangles") == 0)
+      triangles = atoi(option_value(argc, argv, &i));
+    else if (strcmp(argv[i], "-population") == 0)
+      population = atoi(option_value(argc, argv, &i));
+    else if (strcmp(argv[i], "-budget") == 0)
+      headless_budget = atol(option_value(argc, argv, &i));
+    else if (strcmp(argv[i], "-time") == 0)
+      headless_time = atof(option_value(argc, argv, &i));
+    else if (strcmp(argv[i], "-threads") == 0)
+      omp_set_num_threads(atoi(option_value(argc, argv, &i)));
+    else if (strcmp(argv[i], "-batch") == 0)
+      headless_batch = atoi(option_value(argc, argv, &i));
+    else if (strcmp(argv[i], "-seed") == 0)
+      mh_seed = strtoull(option_value(argc, argv, &i), NULL, 10);
+    else if (strcmp(argv[i], "-out") == 0)
+      headless_output = option_value(argc, argv, &i);
+    else if (strcmp(argv[i], "-genome") == 0)
+      headless_genome = option_value(argc, argv, &i);
+    else if (strcmp(argv[i], "-svg") == 0)
+      headless_svg = option_value(argc, argv, &i);
+    else if (strcmp(argv[i], "-snapshot-every") == 0)
+      snapshot_interval = atof(option_value(argc, argv, &i));
+    else if (strcmp(argv[i], "-snapshot-gain") == 0)
+      snapshot_gain = atof(option_value(argc, argv, &i));
+    else if (strcmp(argv[i], "-snapshot-prefix") == 0)
+      snapshot_prefix = option_value(argc, argv, &i);
+    else if (strcmp(argv[i], "-checkpoint") == 0)
+      checkpoint_path = option_value(argc, argv, &i);
+    else if (strcmp(argv[i], "-checkpoint-every") == 0)
+      checkpoint_interval = atof(option_value(argc, argv, &i));
+    else {
+      printf("Unknown option %s.\n", argv[i]);
+      usage();
+      return 0;
+    }
+  }
 
-  mh_init();
-  //ga_init(source, 500, 110);
-  //start(argc, argv, ga_next, ga_best, ga_process);
+  mh_funcs* mh = NULL;
+  for (i = 0; i < sizeof(mhs) / sizeof(mhs[0]); i++)
+    if (strcmp(alg, mhs[i].name) == 0)
+      mh = &mhs[i];
+  if (mh == NULL) {
+    printf("Unknown metaheuristic %s.\n", alg);
+    return 0;
+  }
+  if (triangles < 1 || population < 2) {
+    printf("Need at least 1 triangle and a population of 2.\n");
+    return 0;
+  }
+
+  FILE* input = fopen(argv[1],"rb");
+  if (input == NULL) {
+    printf("Can't open %s.\n", argv[1]);
+    return 0;
+  }
+  image* source = load_image(input);
+  fclose(input);
+  if (source->width == 0) {
+    printf("%s is not a ppm, png or jpeg file.\n", argv[1]);
+    return 0;
+  }
 
-  acc_init(source, 1000);
-  start(argc, argv, acc_next, acc_best, acc_process);
+  if (hsv)
+    set_metric(METRIC_HSV, source);
+  if (inc_enabled)
+    inc_init(source);
+  if (pyr) {
+    build_pyramid(source);
+    pyr_level = pyramid_levels - 1;
+  }
+
+  mh_init();
+  printf("%s, %d triangles, seed %llu\n", mh->name, triangles, mh_seed);
+  if (mh->next == shc_next)
+    shc_init(source, triangles);
+  else if (mh->next == ashc_next)
+    ashc_init(source, triangles);
+  else if (mh->next == sa_next)
+    sa_init(source, triangles);
+  else if (mh->next == acc_next)
+    acc_init(source, triangles);
+  else
+    ga_init(source, triangles, population);
+  checkpoint_resume();
 
-  //sa_init(source, 50);
-  //start(argc, argv, sa_next, sa_best, sa_process);
-  //shc_init(source, 100);
-  //start(argc, argv, shc_next, shc_best, shc_process);
+  if (headless)
+    start_headless(mh->next_batch, mh->best, mh->process_batch);
+  else if (offscreen)
+    start_offscreen(argc, argv, mh->next_batch, mh->best, mh->process_batch);
+  else
+    start(argc, argv, mh->next, mh->best, mh->process);
   return 0;
 }
@@ -8,60 +8,163 @@
 // a next for returning the next tri_image to render,
 // a best which returns the tri_image with the best fitness,
 // and a process callback for processing a tri_image after it has been rendered
+//
+// Each also has batch versions of next and process. next_batch fills an
+// array with up to n tri_images that can be evaluated independently (in
+// parallel) and returns how many it made; process_batch takes them back
+// once evaluated.
 
 #include "wiproj.h"
 #include "mt64.h"
+#include <omp.h>
 #include <stdlib.h>
+#include <string.h>
 
 // General Purpose Functions
+
+// One random number stream per thread, so candidates can be made in
+// parallel. All are derived from mh_seed; thread 0's is the stream
+// init_genrand64(mh_seed) would give. mh_init picks mh_seed from the clock
+// unless it was set to something other than 0 first.
+unsigned long long mh_seed = 0;
+mt64_state* mh_rngs;
+
 void mh_init() {
   //unsigned long long init[4] = {0x42345ULL, 0x23456ULL, 0x34567ULL, 0x45678ULL}, length=4;
   //init_by_array64(init, length);
-  init_genrand64(time(NULL));
+  int i, n = omp_get_max_threads();
+  if (mh_seed == 0)
+    mh_seed = time(NULL);
+  // mt64_state is whole cache lines, so threads don't share any
+  mh_rngs = aligned_alloc(64, n * sizeof(mt64_state));
+  if (mh_rngs == NULL) {
+    printf("Failed to allocate memory.\n");
+    exit(0);
+  }
+  init_genrand64_r(&mh_rngs[0], mh_seed);
+  for (i = 1; i < n; i++) {
+    unsigned long long key[2] = {mh_seed, i};
+    init_by_array64_r(&mh_rngs[i], key, 2);
+  }
+}
+
+// With mh_deterministic set, each candidate is instead made from a stream
+// of its own, seeded from mh_seed, its generation and its slot among the
+// candidates of that generation, so which thread makes it, and so the
+// number of threads, doesn't change the run.
+int mh_deterministic = 0;
+static __thread mt64_state mh_candidate_rng;
+static __thread int mh_candidate_seeded = 0;
+
+// Starts the stream of the candidate of generation gen in slot slot on
+// the calling thread, if mh_deterministic is set
+void mh_stream(int gen, int slot) {
+  if (!mh_deterministic)
+    return;
+  unsigned long long key[3] = {mh_seed, gen, slot};
+  init_by_array64_r(&mh_candidate_rng, key, 3);
+  mh_candidate_seeded = 1;
+}
+
+// The calling thread's random number stream
+mt64_state* mh_rng() {
+  if (mh_candidate_seeded)
+    return &mh_candidate_rng;
+  return &mh_rngs[omp_get_thread_num()];
 }
 
+// Drops a reference to ti, freeing it once no references are left.
+// Metaheuristics call it when they are done with a tri_image, but one
+// may live on as the parent of its copies.
 void free_tri_image(tri_image* ti) {
+  int refs;
   if (ti) {
+    #pragma omp atomic capture
+    refs = --ti->refs;
+    if (refs > 0)
+      return;
+    inc_release(ti);
     if (ti->img) {
       if (ti->img->values) {
-        free(ti->img->values);
+        pool_free(ti->img->values);
       }
-      free(ti->img);
+      pool_free(ti->img);
     }
     if (ti->triangles) {
-      free(ti->triangles);
+      pool_free(ti->triangles);
     }
-    free(ti);
+    pool_free(ti->deltas);
+    pool_free(ti->strip_error);
+    free_tri_image(ti->parent);
+    pool_free(ti);
   }
 }
 
-tri_image* new_tri_image(int size, int gen, int w, int h) {
-  tri_image* ret = malloc(sizeof(tri_image));
+// A tri_image with no triangles yet
+tri_image* blank_tri_image(int size, int gen, int w, int h) {
+  tri_image* ret = pool_alloc(sizeof(tri_image));
   ret->size = size;
   ret->state = 0;
   ret->generation = gen;
-  ret->triangles = malloc(size * sizeof(triangle));
-  ret->img = malloc(sizeof(image));
+  ret->triangles = NULL;
+  ret->img = pool_alloc(sizeof(image));
   ret->img->width = w;
   ret->img->height = h;
-  ret->img->values = malloc(w*h*3*sizeof(GLubyte));
+  ret->img->values = NULL; // allocated by whoever renders it
+  ret->deltas = NULL;
+  ret->ndeltas = ret->cdeltas = 0;
+  ret->refs = 1;
+  ret->parent = NULL;
+  ret->dirty[0] = ret->dirty[1] = 1.0;
+  ret->dirty[2] = ret->dirty[3] = 0.0;
+  ret->patch = NULL;
+  ret->bound = LONG_MAX;
+  ret->strip_error = NULL;
+  ret->nstrips = 0;
   return ret;
 }
 
+tri_image* new_tri_image(int size, int gen, int w, int h) {
+  tri_image* ret = blank_tri_image(size, gen, w, h);
+  ret->triangles = pool_alloc(size * sizeof(triangle));
+  return ret;
+}
+
+// Makes in the parent of ti. May be called from several threads at once.
+void set_parent(tri_image* ti, tri_image* in) {
+  #pragma omp atomic
+  in->refs++;
+  ti->parent = in;
+}
+
+// Grows the dirty rectangle of ti to cover t
+void dirty_triangle(tri_image* ti, triangle* t) {
+  ti->dirty[0] = MIN(ti->dirty[0], MIN(t->x1, MIN(t->x2, t->x3)));
+  ti->dirty[1] = MIN(ti->dirty[1], MIN(t->y1, MIN(t->y2, t->y3)));
+  ti->dirty[2] = MAX(ti->dirty[2], MAX(t->x1, MAX(t->x2, t->x3)));
+  ti->dirty[3] = MAX(ti->dirty[3], MAX(t->y1, MAX(t->y2, t->y3)));
+}
+
+// Same as genrand64_real2 on the output x
+#define REAL2(x) (((x) >> 11) * (1.0/9007199254740992.0))
+
 void new_triangle(triangle* t) {
-  t->x1 = genrand64_real2();
-  t->y1 = genrand64_real2();
-  t->x2 = genrand64_real2();
-  t->y2 = genrand64_real2();
-  t->x3 = genrand64_real2();
-  t->y3 = genrand64_real2();
-  t->r = genrand64_real2();
-  t->g = genrand64_real2();
-  t->b = genrand64_real2();
-  t->a = genrand64_real2();
+  unsigned long long r[10];
+  genrand64_fill_r(mh_rng(), r, 10);
+  t->x1 = REAL2(r[0]);
+  t->y1 = REAL2(r[1]);
+  t->x2 = REAL2(r[2]);
+  t->y2 = REAL2(r[3]);
+  t->x3 = REAL2(r[4]);
+  t->y3 = REAL2(r[5]);
+  t->r = REAL2(r[6]);
+  t->g = REAL2(r[7]);
+  t->b = REAL2(r[8]);
+  t->a = REAL2(r[9]);
 }
 
 tri_image* random_tri_image(int size, int gen, int w, int h) {
+  mh_stream(gen, 0);
   tri_image* ret = new_tri_image(size,gen,w,h);
   int i;
   for (i=0;i<size;i++) {
@@ -83,11 +186,189 @@ void copy_triangle(triangle* tn, triangle* to) {
   tn->a = to->a;
 }
 
-tri_image* copy_tri_image(tri_image* in, int gen) {
-  tri_image* ret = new_tri_image(in->size, gen, in->img->width, in->img->height);
+// The field f of t, numbered as in delta
+GLfloat* triangle_field(triangle* t, int f) {
+  switch (f) {
+    case 0: return &t->x1;
+    case 1: return &t->y1;
+    case 2: return &t->x2;
+    case 3: return &t->y2;
+    case 4: return &t->x3;
+    case 5: return &t->y3;
+    case 6: return &t->r;
+    case 7: return &t->g;
+    case 8: return &t->b;
+    case 9: return &t->a;
+    default:
+      printf("Bad triangle field.\n");
+      exit(0);
+  }
+}
+
+// Copies triangle i of ti, with its deltas applied, to out
+void get_triangle(tri_image* ti, int i, triangle* out) {
+  int k;
+  if (ti->triangles) {
+    copy_triangle(out, &(ti->triangles)[i]);
+    return;
+  }
+  copy_triangle(out, &(ti->parent->triangles)[i]);
+  for (k = 0; k < ti->ndeltas; k++)
+    if (ti->deltas[k].tri == i)
+      *triangle_field(out, ti->deltas[k].field) = ti->deltas[k].value;
+}
+
+// Sets field f of triangle i of a copy on write ti to v
+void set_delta(tri_image* ti, int i, int f, GLfloat v) {
+  int k;
+  for (k = 0; k < ti->ndeltas; k++) {
+    if (ti->deltas[k].tri == i && ti->deltas[k].field == f) {
+      ti->deltas[k].value = v;
+      return;
+    }
+  }
+  if (ti->ndeltas == ti->cdeltas) {
+    ti->cdeltas = MAX(8, 2 * ti->cdeltas);
+    delta* d = pool_alloc(ti->cdeltas * sizeof(delta));
+    for (k = 0; k < ti->ndeltas; k++)
+      d[k] = ti->deltas[k];
+    pool_free(ti->deltas);
+    ti->deltas = d;
+  }
+  ti->deltas[ti->ndeltas].tri = i;
+  ti->deltas[ti->ndeltas].field = f;
+  ti->deltas[ti->ndeltas].value = v;
+  ti->ndeltas++;
+}
+
+// Gives a copy on write ti triangles of its own. The parent is kept, for
+// incremental evaluation.
+void materialize(tri_image* ti) {
   int i;
-  for (i=0;i < in->size; i++)
-    copy_triangle(&(ret->triangles)[i],&(in->triangles)[i]);
+  if (ti->triangles)
+    return;
+  ti->triangles = pool_alloc(ti->size * sizeof(triangle));
+  for (i = 0; i < ti->size; i++)
+    copy_triangle(&(ti->triangles)[i], &(ti->parent->triangles)[i]);
+  for (i = 0; i < ti->ndeltas; i++)
+    *triangle_field(&(ti->triangles)[ti->deltas[i].tri], ti->deltas[i].field) =
+      ti->deltas[i].value;
+  pool_free(ti->deltas);
+  ti->deltas = NULL;
+  ti->ndeltas = ti->cdeltas = 0;
+}
+
+// Makes room for n triangles in s, keeping none of its contents
+void soa_reserve(tri_soa* s, int n) {
+  int f;
+  if (n <= s->capacity)
+    return;
+  int per = SOA_ALIGN / sizeof(GLfloat);
+  s->capacity = (n + per - 1) / per * per;
+  free(s->f[0]);
+  // One block, split into ten arrays
+  s->f[0] = aligned_alloc(SOA_ALIGN, 10 * s->capacity * sizeof(GLfloat));
+  if (s->f[0] == NULL) {
+    printf("Failed to allocate memory.\n");
+    exit(0);
+  }
+  for (f = 1; f < 10; f++)
+    s->f[f] = s->f[0] + f * s->capacity;
+}
+
+// Stores the n triangles t in s
+void tri_to_soa(triangle* t, int n, tri_soa* s) {
+  int i;
+  soa_reserve(s, n);
+  s->size = n;
+  for (i = 0; i < n; i++) {
+    s->f[0][i] = t[i].x1;
+    s->f[1][i] = t[i].y1;
+    s->f[2][i] = t[i].x2;
+    s->f[3][i] = t[i].y2;
+    s->f[4][i] = t[i].x3;
+    s->f[5][i] = t[i].y3;
+    s->f[6][i] = t[i].r;
+    s->f[7][i] = t[i].g;
+    s->f[8][i] = t[i].b;
+    s->f[9][i] = t[i].a;
+  }
+}
+
+// Stores the triangles of s in t, which must have room for s->size
+void tri_from_soa(tri_soa* s, triangle* t) {
+  int i;
+  for (i = 0; i < s->size; i++) {
+    t[i].x1 = s->f[0][i];
+    t[i].y1 = s->f[1][i];
+    t[i].x2 = s->f[2][i];
+    t[i].y2 = s->f[3][i];
+    t[i].x3 = s->f[4][i];
+    t[i].y3 = s->f[5][i];
+    t[i].r = s->f[6][i];
+    t[i].g = s->f[7][i];
+    t[i].b = s->f[8][i];
+    t[i].a = s->f[9][i];
+  }
+}
+
+// Stores the triangles of ti in s. A copy on write ti's deltas are
+// written straight into the field arrays.
+void tri_image_soa(tri_image* ti, tri_soa* s) {
+  int i;
+  if (ti->triangles) {
+    tri_to_soa(ti->triangles, ti->size, s);
+    return;
+  }
+  tri_to_soa(ti->parent->triangles, ti->size, s);
+  for (i = 0; i < ti->ndeltas; i++)
+    s->f[ti->deltas[i].field][ti->deltas[i].tri] = ti->deltas[i].value;
+}
+
+// Stores the n triangles of ti in list, which must be in increasing order,
+// in s
+void tri_image_soa_list(tri_image* ti, int* list, int n, tri_soa* s) {
+  triangle* t = ti->triangles ? ti->triangles : ti->parent->triangles;
+  int i, k;
+  soa_reserve(s, n);
+  s->size = n;
+  for (i = 0; i < n; i++) {
+    triangle* c = &t[list[i]];
+    s->f[0][i] = c->x1;
+    s->f[1][i] = c->y1;
+    s->f[2][i] = c->x2;
+    s->f[3][i] = c->y2;
+    s->f[4][i] = c->x3;
+    s->f[5][i] = c->y3;
+    s->f[6][i] = c->r;
+    s->f[7][i] = c->g;
+    s->f[8][i] = c->b;
+    s->f[9][i] = c->a;
+  }
+  if (ti->triangles)
+    return;
+  for (k = 0; k < ti->ndeltas; k++) {
+    // Where the delta's triangle is in list, if it is
+    int lo = 0, hi = n;
+    while (lo < hi) {
+      int mid = (lo + hi) / 2;
+      if (list[mid] < ti->deltas[k].tri)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    if (lo < n && list[lo] == ti->deltas[k].tri)
+      s->f[ti->deltas[k].field][lo] = ti->deltas[k].value;
+  }
+}
+
+// Makes a copy of in that shares in's triangles, recording only the
+// fields tri_mutate changes, until it is materialized. Rejected
+// candidates never copy the triangles at all. in must have triangles of
+// its own. May be called from several threads at once.
+tri_image* copy_tri_image(tri_image* in, int gen) {
+  tri_image* ret = blank_tri_image(in->size, gen, in->img->width, in->img->height);
+  set_parent(ret, in);
   return ret;
 }
 
@@ -101,13 +382,52 @@ tri_image* cross_tri_image(tri_image* a, tri_image* b, int cross, int gen) {
   return ret;
 }
 
+// Targeted mutation: with mh_targeted set, new triangles are placed around
+// a point picked in proportion to the current best's per tile error (see
+// inc_pick). Only available with incremental evaluation, which keeps that
+// error.
+int mh_targeted = 0;
+
+// Sets *x, *y to a random point in [0,1] x [0,1], most likely where the
+// current best has the most error. Returns 0 if there is no error map.
+int target_point(float* x, float* y) {
+  mt64_state* rng = mh_rng();
+  int t = inc_pick(genrand64_real2_r(rng));
+  if (t < 0)
+    return 0;
+  int w = inc_source->width, h = inc_source->height;
+  int px = (t % inc_cols) * INC_TILE, py = (t / inc_cols) * INC_TILE;
+  *x = (px + genrand64_real2_r(rng) * MIN(INC_TILE, w - px)) / w;
+  *y = (py + genrand64_real2_r(rng) * MIN(INC_TILE, h - py)) / h;
+  return 1;
+}
+
+// A new random triangle, with its vertices around a targeted point if
+// targeting is on
+void place_triangle(triangle* t) {
+  float x, y;
+  new_triangle(t);
+  if (mh_targeted && target_point(&x, &y)) {
+    t->x1 = MAX(0.0, MIN(1.0, x + (t->x1 - 0.5) * TARGET_SPREAD));
+    t->y1 = MAX(0.0, MIN(1.0, y + (t->y1 - 0.5) * TARGET_SPREAD));
+    t->x2 = MAX(0.0, MIN(1.0, x + (t->x2 - 0.5) * TARGET_SPREAD));
+    t->y2 = MAX(0.0, MIN(1.0, y + (t->y2 - 0.5) * TARGET_SPREAD));
+    t->x3 = MAX(0.0, MIN(1.0, x + (t->x3 - 0.5) * TARGET_SPREAD));
+    t->y3 = MAX(0.0, MIN(1.0, y + (t->y3 - 0.5) * TARGET_SPREAD));
+  }
+}
+
 tri_image* expand_tri_image(tri_image* in, int gen, int extra) {
+  mh_stream(gen, 0);
   tri_image* ret = new_tri_image(in->size+extra, gen, in->img->width, in->img->height);
   int i;
   for (i=0;i < in->size; i++)
     copy_triangle(&(ret->triangles)[i],&(in->triangles)[i]);
-  for (i=0;i < extra; i++)
-    new_triangle(&(ret->triangles)[i+in->size]);
+  for (i=0;i < extra; i++) {
+    place_triangle(&(ret->triangles)[i+in->size]);
+    dirty_triangle(ret, &(ret->triangles)[i+in->size]);
+  }
+  set_parent(ret, in);
   return ret;
 }
 
@@ -118,50 +438,31 @@ void float_mutate(float* f, float bw) {
     max = 1.0;
   if (min < 0.0)
     min = 0.0;
-  *f = genrand64_real2() * (max - min) + min;
+  *f = genrand64_real2_r(mh_rng()) * (max - min) + min;
 }
 
 void tri_mutate(tri_image* t, float bw, int tri) {
-  int mx = genrand64_int64() % (t->size*10);
+  int mx = genrand64_int64_r(mh_rng()) % (t->size*10);
   int mt = mx / 10;
   int mp = mx % 10;
   if (tri >= 0)
     mt = tri;
 
-  switch (mp) {
-    case 0:
-      float_mutate(&((t->triangles)[mt].x1),bw);
-      break;
-    case 1:
-      float_mutate(&((t->triangles)[mt].y1),bw);
-      break;
-    case 2:
-      float_mutate(&((t->triangles)[mt].x2),bw);
-      break;
-    case 3:
-      float_mutate(&((t->triangles)[mt].y2),bw);
-      break;
-    case 4:
-      float_mutate(&((t->triangles)[mt].x3),bw);
-      break;
-    case 5:
-      float_mutate(&((t->triangles)[mt].y3),bw);
-      break;
-    case 6:
-      float_mutate(&((t->triangles)[mt].r),bw);
-      break;
-    case 7:
-      float_mutate(&((t->triangles)[mt].g),bw);
-      break;
-    case 8:
-      float_mutate(&((t->triangles)[mt].b),bw);
-      break;
-    case 9:
-      float_mutate(&((t->triangles)[mt].a),bw);
-      break;
-    default:
-      printf("RNG Fail.\n");
-      exit(0);
+  // Past a quarter of the triangles, deltas cost more than a copy
+  if (t->triangles == NULL && t->ndeltas * 4 >= t->size)
+    materialize(t);
+
+  if (t->triangles) {
+    dirty_triangle(t, &(t->triangles)[mt]);
+    float_mutate(triangle_field(&(t->triangles)[mt], mp), bw);
+    dirty_triangle(t, &(t->triangles)[mt]);
+  } else {
+    triangle c;
+    get_triangle(t, mt, &c);
+    dirty_triangle(t, &c);
+    float_mutate(triangle_field(&c, mp), bw);
+    dirty_triangle(t, &c);
+    set_delta(t, mt, mp, *triangle_field(&c, mp));
   }
 }
 
@@ -169,18 +470,76 @@ void tri_mutate(tri_image* t, float bw, int tri) {
 int generation = 0;
 image* isource;
 
+// Level of the pyramid candidates are scored against, see pyr_check. 0 is
+// the source itself.
+int pyr_level = 0;
+
+// Computes ti->error, unless it already has been. If the renderer left ti
+// incomplete, it is rendered and compared tile by tile instead of as a
+// whole image, and only where it differs from the current best when
+// incremental evaluation is enabled.
+// May be called from several threads at once on different tri_images.
+void evaluate(tri_image* ti) {
+  if (ti->state == 2) return;
+  if (pyr_level > 0) {
+    ti->error = raster_diff(ti, pyramid[pyr_level]);
+  } else if (ti->state == 0 && inc_evaluate(ti)) {
+    // Only the tiles ti changed were compared
+  } else if (ti->state == 0) {
+    ti->error = raster_diff(ti, isource);
+  } else {
+    ti->error = image_diff(ti->img, isource);
+  }
+  ti->state = 2;
+}
+
+// Makes ti the current best of a metaheuristic: it gets triangles of its
+// own and becomes the base for incremental evaluation, which only covers
+// the full resolution source. Its parent is no longer needed.
+void accept(tri_image* ti) {
+  materialize(ti);
+  ti->bound = LONG_MAX;
+  if (pyr_level == 0)
+    inc_accept(ti);
+  free_tri_image(ti->parent);
+  ti->parent = NULL;
+}
+
+// Sorts a batch by error, keeping the order of equal errors, so the best
+// candidate is processed first
+void sort_batch(tri_image** batch, int n) {
+  int i, j;
+  for (i = 1; i < n; i++) {
+    tri_image* v = batch[i];
+    j = i-1;
+    while (j >= 0 && batch[j]->error > v->error) {
+      batch[j+1] = batch[j];
+      j = j - 1;
+    }
+    batch[j+1] = v;
+  }
+}
+
 // Stochastic Hill Climber
 int shc_size;
 tri_image* shc_current = NULL;
 
+// A mutant of shc_current. Safe to call from several threads at once.
+tri_image* shc_mutant(int gen) {
+  mh_stream(gen, 0);
+  tri_image* next = copy_tri_image(shc_current,gen);
+  tri_mutate(next, 1.0, -1);
+  // Only an improvement is kept
+  next->bound = shc_current->error;
+
+  return next;
+}
+
 tri_image* shc_next() {
   if (shc_current == NULL) {
     return random_tri_image(shc_size, 0, isource->width, isource->height);
   }
-  tri_image* next = copy_tri_image(shc_current,++generation);
-  tri_mutate(next, 1.0, -1);
-
-  return next;
+  return shc_mutant(++generation);
 }
 
 tri_image* shc_best() {
@@ -188,19 +547,42 @@ tri_image* shc_best() {
 }
 
 void shc_process(tri_image* ti) {
-  ti->error = image_diff(ti->img,isource);
+  evaluate(ti);
 
   if (shc_current == NULL) {
     shc_current = ti;
+    accept(ti);
   } else if (ti->error < shc_current->error) {
     printf("%d,%ld\n", ti->generation, ti->error);
     free_tri_image(shc_current);
     shc_current = ti;
+    accept(ti);
   } else {
     free_tri_image(ti);
   }
 }
 
+int shc_next_batch(tri_image** batch, int n) {
+  int i;
+  if (shc_current == NULL) {
+    batch[0] = shc_next();
+    return 1;
+  }
+  int base = generation;
+  generation += n;
+  #pragma omp parallel for schedule(static) if (n > 1)
+  for (i = 0; i < n; i++)
+    batch[i] = shc_mutant(base + i + 1);
+  return n;
+}
+
+void shc_process_batch(tri_image** batch, int n) {
+  int i;
+  sort_batch(batch, n);
+  for (i = 0; i < n; i++)
+    shc_process(batch[i]);
+}
+
 void shc_init(image* source, int size) {
   isource = source;
   shc_size = size;
@@ -214,14 +596,16 @@ tri_image** ashc_pop;
 float ashc_adj_bw;
 int ashc_adj_count;
 
-tri_image* ashc_next() {
-  if (ashc_p == 0) {
-    return random_tri_image(ashc_size, generation++, isource->width, isource->height);
-  }
+// A child of ashc_pop[0], the slot'th of its generation. Safe to call
+// from several threads at once.
+tri_image* ashc_mutant(int slot) {
+  mh_stream(generation, slot);
   tri_image* next = copy_tri_image(ashc_pop[0],generation);
+  // Only an improvement can replace ashc_pop[0]
+  next->bound = ashc_pop[0]->error;
 
   int i;
-  //for (i = genrand64_int64() % ashc_adj_count; i < ashc_adj_count; i++) {
+  //for (i = genrand64_int64_r(mh_rng()) % ashc_adj_count; i < ashc_adj_count; i++) {
   for (i = 0; i < ashc_adj_count; i++) {
     tri_mutate(next, ashc_adj_bw, -1);
   }
@@ -229,6 +613,13 @@ tri_image* ashc_next() {
   return next;
 }
 
+tri_image* ashc_next() {
+  if (ashc_p == 0) {
+    return random_tri_image(ashc_size, generation++, isource->width, isource->height);
+  }
+  return ashc_mutant(ashc_p);
+}
+
 tri_image* ashc_best() {
   return ashc_pop[0];
 }
@@ -273,7 +664,7 @@ void ashc_adjust_rates() {
 }
 
 void ashc_process(tri_image* ti) {
-  ti->error = image_diff(ti->img,isource);
+  evaluate(ti);
 
   ashc_pop[ashc_p++] = ti;
 
@@ -297,6 +688,27 @@ void ashc_process(tri_image* ti) {
     generation++;
     ashc_last_error = (ashc_pop[0])->error;
   }
+  accept(ashc_pop[0]);
+}
+
+int ashc_next_batch(tri_image** batch, int n) {
+  int i;
+  if (ashc_p == 0) {
+    batch[0] = ashc_next();
+    return 1;
+  }
+  // The rest of this generation's children
+  n = MIN(n, ashc_pop_size - ashc_p);
+  #pragma omp parallel for schedule(static) if (n > 1)
+  for (i = 0; i < n; i++)
+    batch[i] = ashc_mutant(ashc_p + i);
+  return n;
+}
+
+void ashc_process_batch(tri_image** batch, int n) {
+  int i;
+  for (i = 0; i < n; i++)
+    ashc_process(batch[i]);
 }
 
 void ashc_init(image* source, int size) {
@@ -317,21 +729,31 @@ float sa_bw;
 float sa_base = 0.97;
 // 1/sa_cut > sa_imps / sa_i is the point at which sa_bw is multiplied by sa_base
 int sa_min, sa_i = 0, sa_imps = 0, sa_cut = 15;
+int sa_last = 1; // mutants in the last batch processed
 tri_image* sa_current = NULL;
 
-tri_image* sa_next() {
-  if (sa_current == NULL) {
-    return random_tri_image(sa_size, 0, isource->width, isource->height);
-  }
-  tri_image* next = copy_tri_image(sa_current,++generation);
+// A mutant of sa_current. Safe to call from several threads at once.
+tri_image* sa_mutant(int gen) {
+  mh_stream(gen, 0);
+  tri_image* next = copy_tri_image(sa_current,gen);
+  // Only an improvement is kept
+  next->bound = sa_current->error;
 
   int i;
   for (i=0;i<(int)sa_bw+1;i++)
     tri_mutate(next, sa_bw, -1);
 
+  return next;
+}
+
+// Lowers sa_bw when too few mutants have been improvements
+void sa_cool() {
   if (sa_i >= sa_min && sa_imps * sa_cut < sa_i) {
-    sa_i = 0;
-    sa_imps = 0;
+    // What the last batch did past sa_min counts towards the next step,
+    // so steps come every sa_min mutants whatever the batch size
+    int over = sa_i - sa_last < sa_min ? sa_i - sa_min : 0;
+    sa_imps = (long)sa_imps * over / sa_i;
+    sa_i = over;
     sa_bw *= sa_base;
     if (sa_bw < 0.01) {
       // 'Reheat' the system
@@ -340,6 +762,14 @@ tri_image* sa_next() {
       sa_cut++;
     }
   } 
+}
+
+tri_image* sa_next() {
+  if (sa_current == NULL) {
+    return random_tri_image(sa_size, 0, isource->width, isource->height);
+  }
+  tri_image* next = sa_mutant(++generation);
+  sa_cool();
 
   return next;
 }
@@ -349,14 +779,16 @@ tri_image* sa_best() {
 }
 
 void sa_process(tri_image* ti) {
-  ti->error = image_diff(ti->img,isource);
+  evaluate(ti);
 
   if (sa_current == NULL) {
     sa_current = ti;
+    accept(ti);
   } else if (ti->error < sa_current->error) {
     printf("%d,%ld,%f\n", ti->generation, ti->error, sa_bw);
     free_tri_image(sa_current);
     sa_current = ti;
+    accept(ti);
     sa_imps++;
   } else {
     free_tri_image(ti);
@@ -365,6 +797,37 @@ void sa_process(tri_image* ti) {
   sa_i++;
 }
 
+int sa_next_batch(tri_image** batch, int n) {
+  int i;
+  if (sa_current == NULL) {
+    batch[0] = sa_next();
+    return 1;
+  }
+  // sa_i only changes in sa_process, so one cooling step covers the batch
+  int base = generation;
+  generation += n;
+  #pragma omp parallel for schedule(static) if (n > 1)
+  for (i = 0; i < n; i++)
+    batch[i] = sa_mutant(base + i + 1);
+  sa_cool();
+  return n;
+}
+
+void sa_process_batch(tri_image** batch, int n) {
+  int i, imps = sa_imps;
+  // All the mutants were made from sa_current, and each that improves on
+  // it counts towards sa_cool as it would one at a time, though only the
+  // best is kept, so the schedule doesn't depend on the batch size
+  for (i = 0; i < n && sa_current; i++)
+    if (batch[i]->error < sa_current->error)
+      imps++;
+  sort_batch(batch, n);
+  for (i = 0; i < n; i++)
+    sa_process(batch[i]);
+  sa_imps = imps;
+  sa_last = n;
+}
+
 void sa_init(image* source, int size) {
   isource = source;
   sa_size = size;
@@ -376,6 +839,24 @@ void sa_init(image* source, int size) {
 int acc_max, acc_size = 1, acc_i = 0, acc_per = 100, acc_freq = 2, acc_m=10, acc_force = 0;
 tri_image* acc_current = NULL;
 
+// A mutant of acc_current, as made when acc_i is i. Safe to call from
+// several threads at once.
+tri_image* acc_mutant(int i, int gen) {
+  mh_stream(gen, 0);
+  tri_image* next = copy_tri_image(acc_current, gen);
+  // Only an improvement is kept; expansions are made elsewhere
+  next->bound = acc_current->error;
+  int j;
+  for (j=0;j<acc_m;j++) {
+    if (i % acc_freq == 0) {
+      tri_mutate(next, 1.0/((float)j+1), next->size-1);
+    } else {
+      tri_mutate(next, 1.0/((float)j+1), -1);
+    }
+  }
+  return next;
+}
+
 tri_image* acc_next() {
   if (acc_current == NULL) {
     return random_tri_image(acc_size, generation, isource->width, isource->height);
@@ -387,26 +868,42 @@ tri_image* acc_next() {
 
   tri_image *next;
 
-  int i;
   if (acc_i == acc_per + acc_size/10) {
     acc_i = 0;
     acc_size++;
     next = expand_tri_image(acc_current, ++generation, 1);
     acc_force = 1;
   } else {
-    next = copy_tri_image(acc_current, ++generation);
-    for (i=0;i<acc_m;i++) {
-      if (acc_i % acc_freq == 0) {
-        tri_mutate(next, 1.0/((float)i+1), next->size-1);
-      } else {
-        tri_mutate(next, 1.0/((float)i+1), -1);
-      }
-    }
+    next = acc_mutant(acc_i, ++generation);
   }
 
   return next;
 }
 
+int acc_next_batch(tri_image** batch, int n) {
+  int i;
+  if (acc_current == NULL) {
+    batch[0] = acc_next();
+    return 1;
+  }
+  if (acc_size == acc_max) {
+    return sa_next_batch(batch, n);
+  }
+  if (acc_i == acc_per + acc_size/10) {
+    // Expansions are accepted regardless, so they go alone
+    batch[0] = acc_next();
+    return 1;
+  }
+  // Stop at the next expansion
+  n = MIN(n, acc_per + acc_size/10 - acc_i);
+  int base = generation;
+  generation += n;
+  #pragma omp parallel for schedule(static) if (n > 1)
+  for (i = 0; i < n; i++)
+    batch[i] = acc_mutant(acc_i + i, base + i + 1);
+  return n;
+}
+
 tri_image* acc_best() {
   if (acc_size == acc_max && !acc_force) {
     return sa_best();
@@ -415,19 +912,23 @@ tri_image* acc_best() {
 }
 
 void acc_process(tri_image *ti) {
-  ti->error = image_diff(ti->img, isource);
+  evaluate(ti);
 
   if (acc_size == acc_max && !acc_force) {
     sa_process(ti);
+    // sa frees the image acc handed it once it improves on it
+    acc_current = sa_current;
     return;
   }
 
   if (acc_current == NULL) {
     acc_current = ti;
+    accept(ti);
   } else if (ti->error < acc_current->error || acc_force) {
     printf("%d,%ld,%d\n", ti->generation, ti->error,acc_size);
     free_tri_image(acc_current);
     acc_current = ti;
+    accept(ti);
     acc_force = 0;
     if (acc_size==acc_max)
       sa_current = acc_current;
@@ -438,6 +939,19 @@ void acc_process(tri_image *ti) {
   acc_i++;
 }
 
+void acc_process_batch(tri_image** batch, int n) {
+  int i;
+  if (acc_size == acc_max && !acc_force) {
+    // A batch of sa's, see acc_next_batch
+    sa_process_batch(batch, n);
+    acc_current = sa_current;
+    return;
+  }
+  sort_batch(batch, n);
+  for (i = 0; i < n; i++)
+    acc_process(batch[i]);
+}
+
 void acc_init(image* source, int size) {
   isource = source;
   acc_max = size;
@@ -451,36 +965,42 @@ int ga_psize, ga_tsize;
 float ga_mutate_prob;
 float ga_bw;
 
-tri_image* ga_next() {
-  if (!ga_pop[ga_psize-1]) {
-    return random_tri_image(ga_tsize, generation++, isource->width, isource->height);
-  }
-
+// A child of two members of the full population. Safe to call from
+// several threads at once.
+tri_image* ga_child(int gen) {
   tri_image *mother, *father, *child;
+  mh_stream(gen, 0);
 
   // Selection (unbiased random)
   // Roulette wheel selection may be interesting to try
-  mother = ga_pop[genrand64_int64() % ga_psize];
-  father = ga_pop[genrand64_int64() % ga_psize];
+  mother = ga_pop[genrand64_int64_r(mh_rng()) % ga_psize];
+  father = ga_pop[genrand64_int64_r(mh_rng()) % ga_psize];
 
   // Reproduction (one point crossover)
-  int cross = genrand64_int64() % (ga_tsize + 1);
-  child = cross_tri_image(mother, father, cross, generation++);
+  int cross = genrand64_int64_r(mh_rng()) % (ga_tsize + 1);
+  child = cross_tri_image(mother, father, cross, gen);
 
   // Mutation
-  while (genrand64_real2() < ga_mutate_prob) {
+  while (genrand64_real2_r(mh_rng()) < ga_mutate_prob) {
     tri_mutate(child, ga_bw, -1);
   }
 
   return child;
 }
 
+tri_image* ga_next() {
+  if (!ga_pop[ga_psize-1]) {
+    return random_tri_image(ga_tsize, generation++, isource->width, isource->height);
+  }
+  return ga_child(generation++);
+}
+
 tri_image* ga_best() {
   return ga_pop[0];
 }
 
 void ga_process(tri_image *ti) {
-  ti->error = image_diff(ti->img, isource);
+  evaluate(ti);
   tri_image *temp;
   int i;
   // Add to population and remove least fit
@@ -501,6 +1021,32 @@ void ga_process(tri_image *ti) {
   free_tri_image(ti);
 }
 
+int ga_next_batch(tri_image** batch, int n) {
+  int i, empty = 0;
+  for (i = 0; i < ga_psize; i++)
+    if (!ga_pop[i])
+      empty++;
+  // Only fill the population, until it is full
+  if (empty > 0) {
+    n = MIN(n, empty);
+    for (i = 0; i < n; i++)
+      batch[i] = ga_next();
+    return n;
+  }
+  int base = generation;
+  generation += n;
+  #pragma omp parallel for schedule(static) if (n > 1)
+  for (i = 0; i < n; i++)
+    batch[i] = ga_child(base + i);
+  return n;
+}
+
+void ga_process_batch(tri_image** batch, int n) {
+  int i;
+  for (i = 0; i < n; i++)
+    ga_process(batch[i]);
+}
+
 void ga_init(image* source, int tsize, int psize) {
   isource = source;
   ga_tsize = tsize; // Number of triangles
@@ -509,3 +1055,222 @@ void ga_init(image* source, int tsize, int psize) {
   ga_mutate_prob = 0.5;
   ga_bw = 0.2;
 }
+
+// Coarse to fine evaluation
+// With a pyramid built, candidates start out scored against its coarsest
+// level, where they render many times faster. Errors at different levels
+// can't be compared, so when the level changes every tri_image the
+// metaheuristics keep is scored again.
+int pyr_count = 0;     // evaluations at this level since pyr_last was set
+long pyr_last = -1;    // best error then, or -1 at the start of a level
+
+void rescore(tri_image* ti) {
+  if (ti) {
+    ti->state = 0;
+    ti->bound = LONG_MAX;
+    evaluate(ti);
+  }
+}
+
+void pyr_rescore() {
+  int i, n;
+  rescore(shc_current);
+  rescore(sa_current);
+  if (acc_current != sa_current)
+    rescore(acc_current);
+  for (i = 0; i < ashc_p; i++)
+    rescore(ashc_pop[i]);
+  if (ashc_p > 0)
+    ashc_last_error = ashc_pop[0]->error;
+  for (n = 0; ga_pop && n < ga_psize && ga_pop[n]; n++)
+    rescore(ga_pop[n]);
+  sort_batch(ga_pop, n);
+
+  // accept skipped incremental evaluation at the coarser levels, so at
+  // full resolution the bests become its base now
+  if (pyr_level == 0) {
+    if (shc_current)
+      accept(shc_current);
+    if (ashc_p > 0)
+      accept(ashc_pop[0]);
+    if (sa_current)
+      accept(sa_current);
+    if (acc_current && acc_current != sa_current)
+      accept(acc_current);
+  }
+}
+
+// Called by the driver after every n evaluations. Moves to the next finer
+// level once the best error has plateaued at this one.
+void pyr_check(tri_image* best, int n) {
+  if (pyr_level == 0 || best == NULL)
+    return;
+  pyr_count += n;
+  if (pyr_count < PYRAMID_WINDOW)
+    return;
+  if (pyr_last >= 0 && pyr_last - best->error < pyr_last * PYRAMID_PLATEAU) {
+    pyr_level--;
+    pyr_rescore();
+    pyr_last = -1;
+  } else {
+    pyr_last = best->error;
+  }
+  pyr_count = 0;
+}
+
+// Checkpoints
+// Everything a run needs to continue where it left off, see checkpoint.c.
+// Only called between batches, when no candidates are out. The options
+// the metaheuristics were initialized with are stored too, to refuse a
+// checkpoint taken with others. The tri_images kept are stored by value,
+// and come back with triangles of their own.
+
+void save_tri_image(ckpt* c, tri_image* ti) {
+  int present = ti != NULL, i;
+  ckpt_put(c, &present, sizeof(int));
+  if (ti == NULL)
+    return;
+  ckpt_put(c, &ti->generation, sizeof(int));
+  ckpt_put(c, &ti->size, sizeof(int));
+  ckpt_put(c, &ti->error, sizeof(long));
+  for (i = 0; i < ti->size; i++) {
+    triangle t;
+    get_triangle(ti, i, &t);
+    ckpt_put(c, &t, sizeof(triangle));
+  }
+}
+
+tri_image* load_tri_image(ckpt* c) {
+  int present, gen, size;
+  ckpt_get(c, &present, sizeof(int));
+  if (!present)
+    return NULL;
+  ckpt_get(c, &gen, sizeof(int));
+  ckpt_get(c, &size, sizeof(int));
+  tri_image* ti = new_tri_image(size, gen, isource->width, isource->height);
+  ckpt_get(c, &ti->error, sizeof(long));
+  ckpt_get(c, ti->triangles, size * sizeof(triangle));
+  ti->state = 2;
+  return ti;
+}
+
+// The options, which must match between saving and loading
+void mh_options(int* o) {
+  o[0] = shc_size;
+  o[1] = ashc_size;
+  o[2] = ashc_pop_size;
+  o[3] = sa_size;
+  o[4] = acc_max;
+  o[5] = ga_tsize;
+  o[6] = ga_psize;
+}
+
+void mh_save(ckpt* c) {
+  int i, options[7], n = omp_get_max_threads();
+  // Once acc has handed its image to sa, sa may have freed it; what acc
+  // holds then is sa's
+  int shared = sa_current != NULL && (sa_current == acc_current ||
+      (acc_current != NULL && acc_size == acc_max && !acc_force));
+
+  mh_options(options);
+  ckpt_put(c, options, sizeof(options));
+  ckpt_put(c, &mh_seed, sizeof(mh_seed));
+  ckpt_put(c, &n, sizeof(int));
+  ckpt_put(c, mh_rngs, n * sizeof(mt64_state));
+  ckpt_put(c, &generation, sizeof(int));
+  ckpt_put(c, &pyr_level, sizeof(int));
+  ckpt_put(c, &pyr_count, sizeof(int));
+  ckpt_put(c, &pyr_last, sizeof(long));
+
+  save_tri_image(c, shc_current);
+
+  ckpt_put(c, &ashc_p, sizeof(int));
+  ckpt_put(c, &ashc_imps, sizeof(int));
+  ckpt_put(c, &ashc_produced, sizeof(int));
+  ckpt_put(c, &ashc_last_error, sizeof(long));
+  ckpt_put(c, &ashc_adj_bw, sizeof(float));
+  ckpt_put(c, &ashc_adj_count, sizeof(int));
+  for (i = 0; i < ashc_p; i++)
+    save_tri_image(c, ashc_pop[i]);
+
+  ckpt_put(c, &sa_bw, sizeof(float));
+  ckpt_put(c, &sa_i, sizeof(int));
+  ckpt_put(c, &sa_imps, sizeof(int));
+  ckpt_put(c, &sa_cut, sizeof(int));
+  ckpt_put(c, &sa_last, sizeof(int));
+  ckpt_put(c, &shared, sizeof(int));
+  save_tri_image(c, shared ? NULL : sa_current);
+
+  ckpt_put(c, &acc_size, sizeof(int));
+  ckpt_put(c, &acc_i, sizeof(int));
+  ckpt_put(c, &acc_force, sizeof(int));
+  save_tri_image(c, acc_current);
+
+  for (i = 0; i < ga_psize; i++)
+    save_tri_image(c, ga_pop[i]);
+}
+
+// Restores what mh_save stored, in place of the state the metaheuristics
+// were initialized with
+void mh_load(ckpt* c) {
+  int i, options[7], saved[7], n, shared;
+  int threads = omp_get_max_threads();
+
+  mh_options(options);
+  ckpt_get(c, saved, sizeof(saved));
+  if (memcmp(options, saved, sizeof(saved)) != 0) {
+    printf("Checkpoint was taken with other options.\n");
+    exit(0);
+  }
+  ckpt_get(c, &mh_seed, sizeof(mh_seed));
+  ckpt_get(c, &n, sizeof(int));
+  for (i = 0; i < n; i++) {
+    mt64_state s;
+    ckpt_get(c, &s, sizeof(mt64_state));
+    if (i < threads)
+      mh_rngs[i] = s;
+  }
+  ckpt_get(c, &generation, sizeof(int));
+  ckpt_get(c, &pyr_level, sizeof(int));
+  ckpt_get(c, &pyr_count, sizeof(int));
+  ckpt_get(c, &pyr_last, sizeof(long));
+
+  shc_current = load_tri_image(c);
+
+  ckpt_get(c, &ashc_p, sizeof(int));
+  ckpt_get(c, &ashc_imps, sizeof(int));
+  ckpt_get(c, &ashc_produced, sizeof(int));
+  ckpt_get(c, &ashc_last_error, sizeof(long));
+  ckpt_get(c, &ashc_adj_bw, sizeof(float));
+  ckpt_get(c, &ashc_adj_count, sizeof(int));
+  for (i = 0; i < ashc_p; i++)
+    ashc_pop[i] = load_tri_image(c);
+
+  ckpt_get(c, &sa_bw, sizeof(float));
+  ckpt_get(c, &sa_i, sizeof(int));
+  ckpt_get(c, &sa_imps, sizeof(int));
+  ckpt_get(c, &sa_cut, sizeof(int));
+  ckpt_get(c, &sa_last, sizeof(int));
+  ckpt_get(c, &shared, sizeof(int));
+  sa_current = load_tri_image(c);
+
+  ckpt_get(c, &acc_size, sizeof(int));
+  ckpt_get(c, &acc_i, sizeof(int));
+  ckpt_get(c, &acc_force, sizeof(int));
+  acc_current = load_tri_image(c);
+  if (shared)
+    sa_current = acc_current;
+
+  for (i = 0; i < ga_psize; i++)
+    ga_pop[i] = load_tri_image(c);
+
+  // The current bests become the base for incremental evaluation again
+  if (shc_current)
+    accept(shc_current);
+  if (ashc_p > 0)
+    accept(ashc_pop[0]);
+  if (sa_current && !shared)
+    accept(sa_current);
+  if (acc_current)
+    accept(acc_current);
+}
@@ -55,36 +55,43 @@
 
 
 #include <stdio.h>
+#include <string.h>
 #include "mt64.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-#define NN 312
+#define NN MT64_NN
 #define MM 156
 #define MATRIX_A 0xB5026F5AA96619E9ULL
 #define UM 0xFFFFFFFF80000000ULL /* Most significant 33 bits */
 #define LM 0x7FFFFFFFULL /* Least significant 31 bits */
 
 
-/* The array for the state vector */
-static unsigned long long mt[NN]; 
+/* The state used by the functions without _r */
 /* mti==NN+1 means mt[NN] is not initialized */
-static int mti=NN+1; 
+static mt64_state global = { .mti = NN+1 };
 
 /* initializes mt[NN] with a seed */
-void init_genrand64(unsigned long long seed)
+void init_genrand64_r(mt64_state *s, unsigned long long seed)
 {
+    unsigned long long *mt = s->mt;
+    int i;
     mt[0] = seed;
-    for (mti=1; mti<NN; mti++) 
-        mt[mti] =  (6364136223846793005ULL * (mt[mti-1] ^ (mt[mti-1] >> 62)) + mti);
+    for (i=1; i<NN; i++) 
+        mt[i] =  (6364136223846793005ULL * (mt[i-1] ^ (mt[i-1] >> 62)) + i);
+    s->mti = NN;
 }
 
 /* initialize by an array with array-length */
 /* init_key is the array for initializing keys */
 /* key_length is its length */
-void init_by_array64(unsigned long long init_key[],
-		     unsigned long long key_length)
+void init_by_array64_r(mt64_state *s, unsigned long long init_key[],
+		       unsigned long long key_length)
 {
+    unsigned long long *mt = s->mt;
     unsigned long long i, j, k;
-    init_genrand64(19650218ULL);
+    init_genrand64_r(s, 19650218ULL);
     i=1; j=0;
     k = (NN>key_length ? NN : key_length);
     for (; k; k--) {
@@ -104,64 +111,158 @@ void init_by_array64(unsigned long long init_key[],
     mt[0] = 1ULL << 63; /* MSB is 1; assuring non-zero initial array */ 
 }
 
-/* generates a random number on [0, 2^64-1]-interval */
-unsigned long long genrand64_int64(void)
+/* mt[i] for i in [i0,i1), where mt[i+off] is the word MM ahead */
+/* mag01 is selected with a mask instead of a table lookup so the */
+/* loop has no data dependent loads */
+static void twist(unsigned long long *mt, int i0, int i1, int off)
 {
-    int i;
+    int i = i0;
     unsigned long long x;
-    static unsigned long long mag01[2]={0ULL, MATRIX_A};
-
-    if (mti >= NN) { /* generate NN words at one time */
-
-        /* if init_genrand64() has not been called, */
-        /* a default initial seed is used     */
-        if (mti == NN+1) 
-            init_genrand64(5489ULL); 
-
-        for (i=0;i<NN-MM;i++) {
-            x = (mt[i]&UM)|(mt[i+1]&LM);
-            mt[i] = mt[i+MM] ^ (x>>1) ^ mag01[(int)(x&1ULL)];
-        }
-        for (;i<NN-1;i++) {
-            x = (mt[i]&UM)|(mt[i+1]&LM);
-            mt[i] = mt[i+(MM-NN)] ^ (x>>1) ^ mag01[(int)(x&1ULL)];
-        }
-        x = (mt[NN-1]&UM)|(mt[0]&LM);
-        mt[NN-1] = mt[MM-1] ^ (x>>1) ^ mag01[(int)(x&1ULL)];
-
-        mti = 0;
+#ifdef __SSE2__
+    const __m128i um = _mm_set1_epi64x(UM), lm = _mm_set1_epi64x(LM);
+    const __m128i one = _mm_set1_epi64x(1), a = _mm_set1_epi64x(MATRIX_A);
+    const __m128i zero = _mm_setzero_si128();
+    /* words MM apart never fall in the same pair */
+    for (; i+1<i1; i+=2) {
+        __m128i y = _mm_or_si128(
+            _mm_and_si128(_mm_loadu_si128((__m128i*)&mt[i]), um),
+            _mm_and_si128(_mm_loadu_si128((__m128i*)&mt[i+1]), lm));
+        __m128i mag = _mm_and_si128(
+            _mm_sub_epi64(zero, _mm_and_si128(y, one)), a);
+        __m128i r = _mm_xor_si128(_mm_loadu_si128((__m128i*)&mt[i+off]),
+            _mm_xor_si128(_mm_srli_epi64(y, 1), mag));
+        _mm_storeu_si128((__m128i*)&mt[i], r);
+    }
+#endif
+    for (; i<i1; i++) {
+        x = (mt[i]&UM)|(mt[i+1]&LM);
+        mt[i] = mt[i+off] ^ (x>>1) ^ (-(x&1ULL) & MATRIX_A);
+    }
+}
+
+/* generates NN words at one time and tempers them into s->out */
+static void refill(mt64_state *s)
+{
+    unsigned long long *mt = s->mt, *out = s->out;
+    unsigned long long x;
+    int i = 0;
+
+    /* if init_genrand64() has not been called, */
+    /* a default initial seed is used     */
+    if (s->mti == NN+1) 
+        init_genrand64_r(s, 5489ULL); 
+
+    twist(mt, 0, NN-MM, MM);
+    twist(mt, NN-MM, NN-1, MM-NN);
+    x = (mt[NN-1]&UM)|(mt[0]&LM);
+    mt[NN-1] = mt[MM-1] ^ (x>>1) ^ (-(x&1ULL) & MATRIX_A);
+
+#ifdef __SSE2__
+    const __m128i t1 = _mm_set1_epi64x(0x5555555555555555ULL);
+    const __m128i t2 = _mm_set1_epi64x(0x71D67FFFEDA60000ULL);
+    const __m128i t3 = _mm_set1_epi64x(0xFFF7EEE000000000ULL);
+    for (; i+1<NN; i+=2) {
+        __m128i y = _mm_loadu_si128((__m128i*)&mt[i]);
+        y = _mm_xor_si128(y, _mm_and_si128(_mm_srli_epi64(y, 29), t1));
+        y = _mm_xor_si128(y, _mm_and_si128(_mm_slli_epi64(y, 17), t2));
+        y = _mm_xor_si128(y, _mm_and_si128(_mm_slli_epi64(y, 37), t3));
+        y = _mm_xor_si128(y, _mm_srli_epi64(y, 43));
+        _mm_storeu_si128((__m128i*)&out[i], y);
+    }
+#endif
+    for (; i<NN; i++) {
+        x = mt[i];
+        x ^= (x >> 29) & 0x5555555555555555ULL;
+        x ^= (x << 17) & 0x71D67FFFEDA60000ULL;
+        x ^= (x << 37) & 0xFFF7EEE000000000ULL;
+        x ^= (x >> 43);
+        out[i] = x;
     }
-  
-    x = mt[mti++];
 
-    x ^= (x >> 29) & 0x5555555555555555ULL;
-    x ^= (x << 17) & 0x71D67FFFEDA60000ULL;
-    x ^= (x << 37) & 0xFFF7EEE000000000ULL;
-    x ^= (x >> 43);
+    s->mti = 0;
+}
+
+/* generates a random number on [0, 2^64-1]-interval */
+unsigned long long genrand64_int64_r(mt64_state *s)
+{
+    if (s->mti >= NN)
+        refill(s);
+    return s->out[s->mti++];
+}
 
-    return x;
+/* stores the next n numbers on [0, 2^64-1]-interval in out */
+void genrand64_fill_r(mt64_state *s, unsigned long long *out, int n)
+{
+    while (n > 0) {
+        int k;
+        if (s->mti >= NN)
+            refill(s);
+        k = NN - s->mti;
+        if (k > n)
+            k = n;
+        memcpy(out, &s->out[s->mti], k * sizeof(unsigned long long));
+        s->mti += k;
+        out += k;
+        n -= k;
+    }
 }
 
 /* generates a random number on [0, 2^63-1]-interval */
-long long genrand64_int63(void)
+long long genrand64_int63_r(mt64_state *s)
 {
-    return (long long)(genrand64_int64() >> 1);
+    return (long long)(genrand64_int64_r(s) >> 1);
 }
 
 /* generates a random number on [0,1]-real-interval */
-double genrand64_real1(void)
+double genrand64_real1_r(mt64_state *s)
 {
-    return (genrand64_int64() >> 11) * (1.0/9007199254740991.0);
+    return (genrand64_int64_r(s) >> 11) * (1.0/9007199254740991.0);
 }
 
 /* generates a random number on [0,1)-real-interval */
-double genrand64_real2(void)
+double genrand64_real2_r(mt64_state *s)
 {
-    return (genrand64_int64() >> 11) * (1.0/9007199254740992.0);
+    return (genrand64_int64_r(s) >> 11) * (1.0/9007199254740992.0);
 }
 
 /* generates a random number on (0,1)-real-interval */
+double genrand64_real3_r(mt64_state *s)
+{
+    return ((genrand64_int64_r(s) >> 12) + 0.5) * (1.0/4503599627370496.0);
+}
+
+void init_genrand64(unsigned long long seed)
+{
+    init_genrand64_r(&global, seed);
+}
+
+void init_by_array64(unsigned long long init_key[],
+		     unsigned long long key_length)
+{
+    init_by_array64_r(&global, init_key, key_length);
+}
+
+unsigned long long genrand64_int64(void)
+{
+    return genrand64_int64_r(&global);
+}
+
+long long genrand64_int63(void)
+{
+    return genrand64_int63_r(&global);
+}
+
+double genrand64_real1(void)
+{
+    return genrand64_real1_r(&global);
+}
+
+double genrand64_real2(void)
+{
+    return genrand64_real2_r(&global);
+}
+
 double genrand64_real3(void)
 {
-    return ((genrand64_int64() >> 12) + 0.5) * (1.0/4503599627370496.0);
+    return genrand64_real3_r(&global);
 }
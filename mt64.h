@@ -54,6 +54,38 @@
 */
 
 
+/* 
+   The functions ending in _r take the generator state explicitly, so
+   each thread can own a stream. The others share one global state and
+   are not thread safe.
+
+   The state is refilled NN words at a time and the whole block is
+   tempered at once, with SSE2 where available; the outputs are the same
+   as those of the reference implementation.
+*/
+
+#define MT64_NN 312
+
+/* aligned, and so padded, to whole cache lines, so that the states of
+   different threads never share one */
+typedef struct _mt64_state {
+    unsigned long long mt[MT64_NN];  /* the state vector */
+    unsigned long long out[MT64_NN]; /* tempered outputs of the last refill */
+    int mti;                         /* next output; MT64_NN+1 if unseeded */
+} __attribute__((aligned(64))) mt64_state;
+
+void init_genrand64_r(mt64_state *s, unsigned long long seed);
+void init_by_array64_r(mt64_state *s, unsigned long long init_key[],
+		       unsigned long long key_length);
+unsigned long long genrand64_int64_r(mt64_state *s);
+long long genrand64_int63_r(mt64_state *s);
+double genrand64_real1_r(mt64_state *s);
+double genrand64_real2_r(mt64_state *s);
+double genrand64_real3_r(mt64_state *s);
+
+/* stores the next n numbers on [0, 2^64-1]-interval in out */
+void genrand64_fill_r(mt64_state *s, unsigned long long *out, int n);
+
 /* initializes mt[NN] with a seed */
 void init_genrand64(unsigned long long seed);
 
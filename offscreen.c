@@ -0,0 +1,333 @@
+// Kevin Stock
+
+// This file contains a driver that renders tri_images with OpenGL without
+// a window. It plays the role of start() in renderer.c, but the context
+// is an EGL pbuffer, which Mesa's llvmpipe provides on machines with no
+// GPU or display, and candidates are rendered, read back and processed in
+// a plain loop rather than from GLUT's idle callback, so nothing waits on
+// the window system.
+//
+// Like start_headless, it takes candidates in batches, of OFFSCREEN_DEPTH.
+// When the image fits in the pbuffer the batch is pipelined: each
+// candidate's pixels are read back into one of two pixel buffer objects
+// without waiting, and the previous candidate's are mapped and scored in
+// place on the cpu while the gpu renders and transfers the next.
+//
+// With offscreen_preview set, the current best is also shown in a GLUT
+// window. The loop then runs on a thread of its own, and hands the window
+// a copy of the best triangles at most every PREVIEW_INTERVAL
+// milliseconds, so drawing the window never slows evaluation down.
+//
+// The loop runs until interrupted or terminated, or 'q' is pressed in the
+// preview; a checkpoint is taken then, if checkpoint_path is set, and the
+// current best is written to <generation>.ppm in the working directory.
+// The 's' key queues a snapshot of it instead, see snapshot.c.
+
+#define GL_GLEXT_PROTOTYPES
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GL/freeglut.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "wiproj.h"
+
+// Largest pbuffer side asked for; larger images are rendered in tiles
+#define OFFSCREEN_MAX 2048
+
+// Candidates taken from the metaheuristic at a time
+#define OFFSCREEN_DEPTH 8
+
+// Milliseconds between updates of the preview
+#define PREVIEW_INTERVAL 100
+
+int offscreen_preview = 0;
+volatile sig_atomic_t offscreen_stop = 0;
+volatile sig_atomic_t offscreen_save = 0;
+
+int         (*off_next_batch)(tri_image**, int);
+tri_image*  (*off_best)(void);
+void        (*off_process_batch)(tri_image**, int);
+tri_image*  off_batch[OFFSCREEN_DEPTH];
+int         off_n; // candidates in off_batch
+
+// The best triangles, copied for the preview, guarded by preview_lock
+pthread_mutex_t preview_lock = PTHREAD_MUTEX_INITIALIZER;
+triangle* preview_triangles = NULL;
+int preview_size = 0, preview_capacity = 0;
+int preview_generation = -1;
+float preview_aspect;
+int preview_width = 500, preview_height = 500;
+
+void offscreen_interrupt(int sig) {
+  offscreen_stop = 1;
+}
+
+double offscreen_ms() {
+  struct timeval t;
+  gettimeofday(&t, NULL);
+  return t.tv_sec * 1000.0 + t.tv_usec / 1000.0;
+}
+
+// Makes a pbuffer context of up to w x h pixels current on this thread,
+// and sets *tw, *th to its size
+void offscreen_context(int w, int h, int* tw, int* th) {
+  EGLDisplay d = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+  EGLint major, minor, n;
+  if (d == EGL_NO_DISPLAY || !eglInitialize(d, &major, &minor)) {
+    // No window system; Mesa can still render without one
+    PFNEGLGETPLATFORMDISPLAYEXTPROC get_display =
+      (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    d = get_display ?
+      get_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL) :
+      EGL_NO_DISPLAY;
+    if (d == EGL_NO_DISPLAY || !eglInitialize(d, &major, &minor)) {
+      printf("Failed to initialize EGL.\n");
+      exit(0);
+    }
+  }
+
+  EGLint config_attribs[] = {
+    EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+    EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8,
+    EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+    EGL_NONE
+  };
+  EGLConfig config;
+  if (!eglChooseConfig(d, config_attribs, &config, 1, &n) || n == 0) {
+    printf("No EGL config for an OpenGL pbuffer.\n");
+    exit(0);
+  }
+
+  *tw = MIN(w, OFFSCREEN_MAX);
+  *th = MIN(h, OFFSCREEN_MAX);
+  EGLint surface_attribs[] = { EGL_WIDTH, *tw, EGL_HEIGHT, *th, EGL_NONE };
+  EGLSurface s = eglCreatePbufferSurface(d, config, surface_attribs);
+  eglBindAPI(EGL_OPENGL_API);
+  EGLContext c = eglCreateContext(d, config, EGL_NO_CONTEXT, NULL);
+  if (s == EGL_NO_SURFACE || c == EGL_NO_CONTEXT || !eglMakeCurrent(d, s, s, c)) {
+    printf("Failed to create an offscreen OpenGL context.\n");
+    exit(0);
+  }
+}
+
+// Copies the triangles of ti for the preview if it is new and the last
+// copy is old enough
+void preview_offer(tri_image* ti) {
+  static double last = 0;
+  double now = offscreen_ms();
+  if (ti->generation == preview_generation || now - last < PREVIEW_INTERVAL)
+    return;
+  last = now;
+
+  int i;
+  pthread_mutex_lock(&preview_lock);
+  if (preview_capacity < ti->size) {
+    preview_capacity = ti->size;
+    free(preview_triangles);
+    preview_triangles = checked_malloc(preview_capacity * sizeof(triangle));
+  }
+  for (i = 0; i < ti->size; i++)
+    get_triangle(ti, i, &preview_triangles[i]);
+  preview_size = ti->size;
+  preview_generation = ti->generation;
+  pthread_mutex_unlock(&preview_lock);
+}
+
+// Starts reading the pixels just rendered into pbo
+void offscreen_read(GLuint pbo, int w, int h) {
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+  glReadPixels(0, 0, w, h, GL_RGB, GL_UNSIGNED_BYTE, (GLvoid*)0);
+}
+
+// Scores ti from the pixels read into pbo, where they are mapped. They
+// are only copied to ti's image if it improves on the current best, as
+// only those can be kept; the others are left without pixels, like fused
+// candidates, and are rendered again if they are ever written out.
+void offscreen_score(tri_image* ti, GLuint pbo) {
+  image* img = ti->img;
+  if (pyr_level > 0) {
+    // Scored against the pyramid, which the pixels are of no use for
+    evaluate(ti);
+    return;
+  }
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+  GLubyte* p = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+  if (p == NULL) {
+    printf("Failed to map a pixel buffer.\n");
+    exit(0);
+  }
+  image mapped = {img->width, img->height, p};
+  ti->error = image_diff(&mapped, isource);
+  ti->state = 2;
+  tri_image* best = off_best();
+  if (best == NULL || ti->error < best->error) {
+    image_alloc(img);
+    memcpy(img->values, p, img->width * img->height * 3);
+  }
+  glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+}
+
+// Renders and scores the n candidates of batch, which fit in the
+// framebuffer, reading each back while the previous one is scored. The
+// last one's read can't overlap anything: the batch has to be processed
+// before the next can be made, so one transfer in n is waited for.
+void offscreen_pipeline(tri_image** batch, int n, GLuint* pbo) {
+  int i;
+  for (i = 0; i < n; i++) {
+    image* img = batch[i]->img;
+    materialize(batch[i]);
+    load_triangles(batch[i]->triangles, batch[i]->size);
+    draw_loaded();
+    offscreen_read(pbo[i % 2], img->width, img->height);
+    if (i > 0)
+      offscreen_score(batch[i-1], pbo[(i-1) % 2]);
+  }
+  if (n > 0)
+    offscreen_score(batch[n-1], pbo[(n-1) % 2]);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+// Renders, scores and processes batches of candidates until told to stop
+void* offscreen_loop(void* arg) {
+  int w = isource->width, h = isource->height;
+  int tw, th, i;
+  GLuint pbo[2];
+
+  offscreen_context(w, h, &tw, &th);
+  myInit();
+
+  // Without tiles, the whole image is drawn at once with a fixed projection
+  int piped = tw == w && th == h;
+  if (piped) {
+    glViewport(0, 0, w, h);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glGenBuffers(2, pbo);
+    for (i = 0; i < 2; i++) {
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo[i]);
+      glBufferData(GL_PIXEL_PACK_BUFFER, w * h * 3, NULL, GL_STREAM_READ);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  }
+
+  while (!offscreen_stop) {
+    off_n = off_next_batch(off_batch, OFFSCREEN_DEPTH);
+    if (piped) {
+      offscreen_pipeline(off_batch, off_n, pbo);
+    } else {
+      for (i = 0; i < off_n; i++) {
+        render_tri_image(off_batch[i], tw, th, 0);
+        evaluate(off_batch[i]);
+      }
+    }
+    off_process_batch(off_batch, off_n);
+    checkpoint_tick();
+    tri_image* best = off_best();
+    if (offscreen_save && best != NULL) {
+      snapshot_save(best);
+      offscreen_save = 0;
+    }
+    snapshot_tick(best);
+    if (offscreen_preview && best != NULL)
+      preview_offer(best);
+  }
+
+  checkpoint_finish();
+  snapshot_finish();
+  // ga and ashc have no best until a batch has been processed
+  if (off_best() != NULL)
+    save_best(off_best());
+  pool_print_stats();
+  return NULL;
+}
+
+void preview_display() {
+  float w_aspect = (float) preview_width / (float) preview_height;
+  glMatrixMode(GL_PROJECTION);
+  glLoadIdentity();
+  if (w_aspect > preview_aspect) {
+    gluOrtho2D(0.5-(w_aspect/preview_aspect)/2.0,0.5+(w_aspect/preview_aspect)/2.0,0,1);
+  } else {
+    gluOrtho2D(0,1,0.5-(preview_aspect/w_aspect)/2.0,0.5+(preview_aspect/w_aspect)/2.0);
+  }
+  glMatrixMode(GL_MODELVIEW);
+
+  pthread_mutex_lock(&preview_lock);
+  load_triangles(preview_triangles, preview_size);
+  pthread_mutex_unlock(&preview_lock);
+  draw_loaded();
+  glFlush();
+  glutSwapBuffers();
+}
+
+void preview_reshape(GLsizei w, GLsizei h) {
+  preview_width = w;
+  preview_height = h;
+  glViewport(0, 0, w, h);
+  glutPostRedisplay();
+}
+
+void preview_keyboard(unsigned char key, int x, int y) {
+  if (key == 'q')
+    offscreen_stop = 1;
+  if (key == 's')
+    offscreen_save = 1;
+}
+
+void preview_timer(int value) {
+  static int shown = -1;
+  if (offscreen_stop) {
+    glutLeaveMainLoop();
+    return;
+  }
+  pthread_mutex_lock(&preview_lock);
+  int changed = preview_generation != shown;
+  shown = preview_generation;
+  pthread_mutex_unlock(&preview_lock);
+  if (changed)
+    glutPostRedisplay();
+  glutTimerFunc(PREVIEW_INTERVAL, preview_timer, 0);
+}
+
+void start_offscreen(
+    int argc, char** argv,
+    int         (*next_batch)(tri_image**, int),
+    tri_image*  (*best)(void),
+    void        (*process_batch)(tri_image**, int)) {
+  off_next_batch = next_batch;
+  off_best = best;
+  off_process_batch = process_batch;
+  signal(SIGINT, offscreen_interrupt);
+  signal(SIGTERM, offscreen_interrupt);
+
+  if (!offscreen_preview) {
+    offscreen_loop(NULL);
+    return;
+  }
+
+  pthread_t loop;
+  preview_aspect = (float) isource->width / (float) isource->height;
+  glutInit(&argc, argv);
+  glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGBA);
+  glutInitWindowPosition(0,0);
+  glutInitWindowSize(preview_width, preview_height);
+  glutCreateWindow("wiproj preview");
+  glutSetOption(GLUT_ACTION_ON_WINDOW_CLOSE, GLUT_ACTION_GLUTMAINLOOP_RETURNS);
+  glutDisplayFunc(preview_display);
+  glutReshapeFunc(preview_reshape);
+  glutKeyboardFunc(preview_keyboard);
+  glutTimerFunc(PREVIEW_INTERVAL, preview_timer, 0);
+  myInit();
+
+  if (pthread_create(&loop, NULL, offscreen_loop, NULL) != 0) {
+    printf("Failed to start the evaluation thread.\n");
+    exit(0);
+  }
+  glutMainLoop();
+  // The window was closed or 'q' pressed
+  offscreen_stop = 1;
+  pthread_join(loop, NULL);
+}
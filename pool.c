@@ -0,0 +1,110 @@
+// Kevin Stock
+
+// This file contains a pool allocator for the memory candidates are made
+// of: tri_images, their triangles and rendered images, and incremental
+// evaluation patches. Blocks are grouped into power of two size classes.
+// A freed block goes on its class's free list and is handed out again by
+// the next allocation of that class, so once a metaheuristic reaches a
+// steady state nothing is allocated from or returned to the system.
+//
+// next_batch builds candidates on several threads while process frees
+// them on one, so the free lists are shared and guarded by a lock.
+//
+// Built with -DPOOL_SYSTEM every block comes from and goes back to
+// malloc and free, so tools like AddressSanitizer see blocks used after
+// they are freed, which the pool would otherwise hand out again.
+
+#include "wiproj.h"
+#include <stddef.h>
+#include <stdlib.h>
+
+// Smallest and number of size classes; class c holds blocks of 2^c bytes,
+// header included
+#define POOL_MIN_CLASS 5
+#define POOL_CLASSES 48
+
+// Kept in front of every block
+typedef union _pool_block {
+  struct {
+    union _pool_block* next; // next free block of the class, while free
+    int cls;
+  } h;
+  max_align_t align;         // keeps what follows the header aligned
+} pool_block;
+
+pool_block* pool_free_list[POOL_CLASSES];
+long pool_hits = 0, pool_misses = 0;
+size_t pool_bytes = 0; // from the system, in use or free
+
+static int pool_class(size_t size) {
+  int c = POOL_MIN_CLASS;
+  size += sizeof(pool_block);
+  while (((size_t)1 << c) < size)
+    c++;
+  return c;
+}
+
+#ifdef POOL_SYSTEM
+
+void* pool_alloc(size_t size) {
+  pool_misses++;
+  return checked_malloc(size);
+}
+
+void pool_free(void* p) {
+  free(p);
+}
+
+#else
+
+void* pool_alloc(size_t size) {
+  int c = pool_class(size);
+  pool_block* b;
+
+  #pragma omp critical(pool)
+  {
+    b = pool_free_list[c];
+    if (b) {
+      pool_free_list[c] = b->h.next;
+      pool_hits++;
+    } else {
+      pool_misses++;
+      pool_bytes += (size_t)1 << c;
+    }
+  }
+
+  if (b == NULL) {
+    b = checked_malloc((size_t)1 << c);
+    b->h.cls = c;
+  }
+  return b + 1;
+}
+
+void pool_free(void* p) {
+  if (p == NULL)
+    return;
+  pool_block* b = (pool_block*)p - 1;
+
+  #pragma omp critical(pool)
+  {
+    b->h.next = pool_free_list[b->h.cls];
+    pool_free_list[b->h.cls] = b;
+  }
+}
+
+#endif
+
+// malloc, but a run can't go on without the memory, so it ends there
+void* checked_malloc(size_t size) {
+  void* ret = malloc(size);
+  if (ret == NULL) {
+    printf("Failed to allocate memory.\n");
+    exit(0);
+  }
+  return ret;
+}
+
+void pool_print_stats() {
+  printf("Pool: %ld hits, %ld misses, %zu bytes\n",
+      pool_hits, pool_misses, pool_bytes);
+}
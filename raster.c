@@ -0,0 +1,564 @@
+// Kevin Stock
+
+// This file contains a software rasterizer for tri_images. It produces
+// approximately the same image as the OpenGL path in renderer.c (an
+// orthographic [0,1] x [0,1] projection, cleared to black, blended with
+// GL_SRC_ALPHA and GL_ONE_MINUS_SRC_ALPHA into an 8 bit framebuffer)
+// without needing a display or a GL context. Against Mesa's llvmpipe,
+// about a fifth of the samples differ, almost all by 1 from the rounding
+// of blending; a few pixels on edges, whose centers the two disagree on
+// covering, differ by more.
+//
+// Pixel (i,j) is covered by a triangle if its center ((i+0.5)/w, (j+0.5)/h)
+// is inside it. Pixels whose centers fall exactly on an edge are assigned
+// with a top-left rule so that triangles sharing an edge don't both draw it.
+
+#include "wiproj.h"
+#include <math.h>
+#include <stdlib.h>
+
+// Per triangle values needed for scan conversion and blending
+typedef struct _tri_setup {
+  float x[3], y[3]; // vertices in pixel coordinates, counter clockwise
+  float dx[3], dy[3]; // edge e runs from vertex e to vertex e+1
+  float slope[3];   // dx / dy of each edge
+  int xmin, xmax;   // columns the triangle may cover
+  int ymin, ymax;   // rows the triangle may cover
+  int src[3];       // color * alpha * 255 in 16.16 fixed point, plus 1/2
+  int inv;          // 1 - alpha in 16.16 fixed point
+} tri_setup;
+
+// Rounds a pixel coordinate to the 1/256 pixel grid GL implementations
+// rasterize on, so coverage of pixels near edges matches
+static inline float snap(float v) {
+  return rintf(v * 256.0f) / 256.0f;
+}
+
+// Values of many triangles, one array per value, so setup_boxes can
+// compute them with SIMD
+typedef struct _tri_boxes {
+  int capacity;
+  float* x[3], * y[3]; // vertices in pixel coordinates, in given order
+  float* area;         // twice the signed area, positive if counter clockwise
+  int* xmin, * xmax;   // as in tri_setup; xmax is -1 if no pixel centers
+  int* ymin, * ymax;   // are covered
+} tri_boxes;
+
+// Snaps the vertices of the triangles in t and finds the pixels each may
+// cover
+static inline __attribute__((always_inline))
+void boxes_kernel(tri_soa* t, int w, int h, tri_boxes* b) {
+  const float* restrict tx1 = t->f[0], * restrict ty1 = t->f[1];
+  const float* restrict tx2 = t->f[2], * restrict ty2 = t->f[3];
+  const float* restrict tx3 = t->f[4], * restrict ty3 = t->f[5];
+  float* restrict bx1 = b->x[0], * restrict by1 = b->y[0];
+  float* restrict bx2 = b->x[1], * restrict by2 = b->y[1];
+  float* restrict bx3 = b->x[2], * restrict by3 = b->y[2];
+  float* restrict barea = b->area;
+  int* restrict bxmin = b->xmin, * restrict bxmax = b->xmax;
+  int* restrict bymin = b->ymin, * restrict bymax = b->ymax;
+  int i;
+
+  #pragma omp simd
+  for (i = 0; i < t->size; i++) {
+    float x1 = snap(tx1[i] * w), y1 = snap(ty1[i] * h);
+    float x2 = snap(tx2[i] * w), y2 = snap(ty2[i] * h);
+    float x3 = snap(tx3[i] * w), y3 = snap(ty3[i] * h);
+    float area = (x2 - x1) * (y3 - y1) - (y2 - y1) * (x3 - x1);
+    int xmin = (int)ceilf(MIN(x1, MIN(x2, x3)) - 0.5f);
+    int xmax = (int)floorf(MAX(x1, MAX(x2, x3)) - 0.5f);
+    int ymin = (int)ceilf(MIN(y1, MIN(y2, y3)) - 0.5f);
+    int ymax = (int)floorf(MAX(y1, MAX(y2, y3)) - 0.5f);
+    xmin = MAX(xmin, 0);
+    xmax = MIN(xmax, w - 1);
+    ymin = MAX(ymin, 0);
+    ymax = MIN(ymax, h - 1);
+    bx1[i] = x1; by1[i] = y1;
+    bx2[i] = x2; by2[i] = y2;
+    bx3[i] = x3; by3[i] = y3;
+    barea[i] = area;
+    bxmin[i] = xmin;
+    bxmax[i] = (area == 0.0f || ymin > ymax || xmin > xmax) ? -1 : xmax;
+    bymin[i] = ymin;
+    bymax[i] = ymax;
+  }
+}
+
+static void boxes_scalar(tri_soa* t, int w, int h, tri_boxes* b) {
+  boxes_kernel(t, w, h, b);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static void boxes_avx2(tri_soa* t, int w, int h, tri_boxes* b) {
+  boxes_kernel(t, w, h, b);
+}
+
+__attribute__((target("avx512f")))
+static void boxes_avx512(tri_soa* t, int w, int h, tri_boxes* b) {
+  boxes_kernel(t, w, h, b);
+}
+#endif
+
+static void boxes_select(tri_soa* t, int w, int h, tri_boxes* b);
+
+// Computes boxes for every triangle of t, 8 or 16 at a time if the cpu
+// supports it. Picked on the first call.
+static void (*setup_boxes)(tri_soa* t, int w, int h, tri_boxes* b) = boxes_select;
+
+static void boxes_select(tri_soa* t, int w, int h, tri_boxes* b) {
+  void (*pick)(tri_soa* t, int w, int h, tri_boxes* b) = boxes_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f"))
+    pick = boxes_avx512;
+  else if (__builtin_cpu_supports("avx2"))
+    pick = boxes_avx2;
+#endif
+  setup_boxes = pick;
+  setup_boxes(t, w, h, b);
+}
+
+// Makes room for n triangles in b, keeping none of its contents
+static void boxes_reserve(tri_boxes* b, int n) {
+  if (n <= b->capacity)
+    return;
+  int per = SOA_ALIGN / sizeof(float);
+  int k;
+  b->capacity = (n + per - 1) / per * per;
+  free(b->x[0]);
+  // One block, split into eleven arrays of 4 byte values
+  b->x[0] = aligned_alloc(SOA_ALIGN, 11 * b->capacity * sizeof(float));
+  if (b->x[0] == NULL) {
+    printf("Failed to allocate memory.\n");
+    exit(0);
+  }
+  for (k = 1; k < 3; k++)
+    b->x[k] = b->x[0] + k * b->capacity;
+  for (k = 0; k < 3; k++)
+    b->y[k] = b->x[0] + (3 + k) * b->capacity;
+  b->area = b->x[0] + 6 * b->capacity;
+  b->xmin = (int*)(b->x[0] + 7 * b->capacity);
+  b->xmax = (int*)(b->x[0] + 8 * b->capacity);
+  b->ymin = (int*)(b->x[0] + 9 * b->capacity);
+  b->ymax = (int*)(b->x[0] + 10 * b->capacity);
+}
+
+// Finishes the setup of visible triangle i
+static void setup_triangle(tri_soa* t, tri_boxes* b, int i, tri_setup* s) {
+  s->x[0] = b->x[0][i];
+  s->y[0] = b->y[0][i];
+  if (b->area[i] > 0.0f) {
+    s->x[1] = b->x[1][i]; s->y[1] = b->y[1][i];
+    s->x[2] = b->x[2][i]; s->y[2] = b->y[2][i];
+  } else {
+    s->x[1] = b->x[2][i]; s->y[1] = b->y[2][i];
+    s->x[2] = b->x[1][i]; s->y[2] = b->y[1][i];
+  }
+
+  int e;
+  for (e = 0; e < 3; e++) {
+    s->dx[e] = s->x[(e+1)%3] - s->x[e];
+    s->dy[e] = s->y[(e+1)%3] - s->y[e];
+    s->slope[e] = s->dy[e] == 0.0f ? 0.0f : s->dx[e] / s->dy[e];
+  }
+
+  s->xmin = b->xmin[i];
+  s->xmax = b->xmax[i];
+  s->ymin = b->ymin[i];
+  s->ymax = b->ymax[i];
+
+  float r = t->f[6][i], g = t->f[7][i], bl = t->f[8][i], a = t->f[9][i];
+  s->src[0] = (int)(r * a * 255.0f * 65536.0f) + 32768;
+  s->src[1] = (int)(g * a * 255.0f * 65536.0f) + 32768;
+  s->src[2] = (int)(bl * a * 255.0f * 65536.0f) + 32768;
+  s->inv = (int)((1.0f - a) * 65536.0f);
+}
+
+// Narrows the columns [*lo, *hi] of the row with pixel center cy to those
+// inside the triangle. Each edge a->b of a counter clockwise triangle bounds
+// the centers from one side; left and top edges include centers exactly on
+// them.
+static void row_span(tri_setup* s, float cy, int* lo, int* hi) {
+  float tmin = *lo - 1.0f, tmax = *hi + 1.0f;
+  int e;
+  for (e = 0; e < 3; e++) {
+    float dx = s->dx[e], dy = s->dy[e];
+    // inside: dx * (cy - ay) - dy * (cx - ax) >= 0
+    int inclusive = dy < 0.0f || (dy == 0.0f && dx < 0.0f);
+    if (dy == 0.0f) {
+      float c = dx * (cy - s->y[e]);
+      if (c < 0.0f || (c == 0.0f && !inclusive)) {
+        *lo = 1;
+        *hi = 0;
+        return;
+      }
+    } else {
+      // column whose center lies on the edge
+      float t = s->x[e] + (cy - s->y[e]) * s->slope[e] - 0.5f;
+      int v;
+      t = MAX(tmin, MIN(tmax, t));
+      if (dy < 0.0f) {
+        // centers right of the edge
+        v = inclusive ? (int)ceilf(t) : (int)floorf(t) + 1;
+        if (v > *lo) *lo = v;
+      } else {
+        // centers left of the edge
+        v = inclusive ? (int)floorf(t) : (int)ceilf(t) - 1;
+        if (v < *hi) *hi = v;
+      }
+    }
+  }
+}
+
+// Composites one triangle over the pixels [x0,x1) x [y0,y1). out points
+// at pixel (x0,y0) and rows are stride bytes apart.
+static void raster_triangle(tri_setup* s, GLubyte* out, int stride,
+    int x0, int y0, int x1, int y1) {
+  int ya = MAX(s->ymin, y0);
+  int yb = MIN(s->ymax, y1 - 1);
+  int j;
+  for (j = ya; j <= yb; j++) {
+    int lo = MAX(x0, s->xmin), hi = MIN(x1 - 1, s->xmax);
+    row_span(s, j + 0.5f, &lo, &hi);
+    GLubyte* p = out + (j - y0) * stride + (lo - x0) * 3;
+    int i;
+    for (i = lo; i <= hi; i++, p += 3) {
+      p[0] = (s->src[0] + p[0] * s->inv) >> 16;
+      p[1] = (s->src[1] + p[1] * s->inv) >> 16;
+      p[2] = (s->src[2] + p[2] * s->inv) >> 16;
+    }
+  }
+}
+
+// Sets up the triangles of ti, rendered w by h, that may cover pixels in
+// [x0,x1) x [y0,y1), in drawing order. If list is not NULL only the nlist
+// triangles it gives, in order, are considered. The array is reused between
+// calls on the same thread; *n is set to its length. The triangles are
+// converted to arrays per field so their vertices and boxes are computed
+// many at a time, and only the triangles that overlap the region are set
+// up further.
+static tri_setup* setup_tri_image(tri_image* ti, int* list, int nlist,
+    int w, int h, int x0, int y0, int x1, int y1, int* n) {
+  static __thread tri_setup* setups = NULL;
+  static __thread int capacity = 0;
+  static __thread tri_soa soa;
+  static __thread tri_boxes boxes;
+  int i;
+
+  if (capacity < ti->size) {
+    capacity = ti->size;
+    setups = realloc(setups, capacity * sizeof(tri_setup));
+    if (setups == NULL) {
+      printf("Failed to allocate memory.\n");
+      exit(0);
+    }
+  }
+
+  if (list)
+    tri_image_soa_list(ti, list, nlist, &soa);
+  else
+    tri_image_soa(ti, &soa);
+  boxes_reserve(&boxes, soa.size);
+  setup_boxes(&soa, w, h, &boxes);
+
+  *n = 0;
+  for (i = 0; i < soa.size; i++) {
+    if (boxes.xmax[i] < x0 || boxes.xmin[i] >= x1 ||
+        boxes.ymax[i] < y0 || boxes.ymin[i] >= y1)
+      continue;
+    setup_triangle(&soa, &boxes, i, &setups[(*n)++]);
+  }
+  return setups;
+}
+
+// Sets the region [x0,x1) x [y0,y1), which out points at, to black
+static void raster_clear(GLubyte* out, int stride,
+    int x0, int y0, int x1, int y1) {
+  int i, j;
+  for (j = 0; j < y1 - y0; j++)
+    for (i = 0; i < (x1 - x0) * 3; i++)
+      out[j*stride + i] = 0;
+}
+
+// Clears the region [x0,x1) x [y0,y1) and composites the triangles that
+// overlap it, see raster_region
+static void raster_setups(tri_setup* s, int n, GLubyte* out, int stride,
+    int x0, int y0, int x1, int y1) {
+  int i;
+  raster_clear(out, stride, x0, y0, x1, y1);
+  for (i = 0; i < n; i++) {
+    if (s[i].xmax < x0 || s[i].xmin >= x1 || s[i].ymax < y0 || s[i].ymin >= y1)
+      continue;
+    raster_triangle(&s[i], out, stride, x0, y0, x1, y1);
+  }
+}
+
+int raster_tiled = 0;
+
+// Triangles set up by raster_prepare on this thread
+static __thread tri_setup* prepared;
+static __thread int nprepared;
+
+// Sets up ti so that raster_prepared can render parts of the region
+// [x0,x1) x [y0,y1) of it, one after another, without setting up its
+// triangles again
+void raster_prepare(tri_image* ti, int x0, int y0, int x1, int y1) {
+  prepared = setup_tri_image(ti, NULL, 0, ti->img->width, ti->img->height,
+      x0, y0, x1, y1, &nprepared);
+}
+
+// As raster_prepare, but only the n triangles of ti in list, which must be
+// in drawing order and include every triangle that may cover the region,
+// are set up; see grid_query
+void raster_prepare_list(tri_image* ti, int* list, int n,
+    int x0, int y0, int x1, int y1) {
+  prepared = setup_tri_image(ti, list, n, ti->img->width, ti->img->height,
+      x0, y0, x1, y1, &nprepared);
+}
+
+// Renders [x0,x1) x [y0,y1), within the region given to raster_prepare,
+// of the tri_image last prepared on this thread, see raster_region
+void raster_prepared(GLubyte* out, int stride, int x0, int y0, int x1, int y1) {
+  raster_setups(prepared, nprepared, out, stride, x0, y0, x1, y1);
+}
+
+// Finds the tiles, as numbered by raster_region, that the box of s covers
+// within the region; returns 0 if there are none
+static int tile_span(tri_setup* s, int x0, int y0, int x1, int y1,
+    int* c0, int* c1, int* r0, int* r1) {
+  if (s->xmax < x0 || s->xmin >= x1 || s->ymax < y0 || s->ymin >= y1)
+    return 0;
+  *c0 = (MAX(s->xmin, x0) - x0) / RASTER_TILE_W;
+  *c1 = (MIN(s->xmax, x1 - 1) - x0) / RASTER_TILE_W;
+  *r0 = (MAX(s->ymin, y0) - y0) / RASTER_TILE_H;
+  *r1 = (MIN(s->ymax, y1 - 1) - y0) / RASTER_TILE_H;
+  return 1;
+}
+
+// Sorts the n setups s by the tiles of the region that their boxes cover,
+// so that each tile visits only its own triangles rather than testing all
+// of them: tile t's are s[(*bins)[k]] for k from (*start)[t] up to
+// (*start)[t+1], in drawing order. The arrays are reused between calls on
+// the same thread.
+static void raster_bin(tri_setup* s, int n, int x0, int y0, int x1, int y1,
+    int cols, int tiles, int** start, int** bins) {
+  static __thread int* first = NULL, * list = NULL;
+  static __thread int nfirst = 0, nlist = 0;
+  int c0, c1, r0, r1, c, r, i, t, total;
+
+  if (nfirst < tiles + 1) {
+    nfirst = tiles + 1;
+    free(first);
+    first = checked_malloc(nfirst * sizeof(int));
+  }
+  for (t = 0; t <= tiles; t++)
+    first[t] = 0;
+  // Count each tile's triangles in the entry after it
+  for (i = 0; i < n; i++)
+    if (tile_span(&s[i], x0, y0, x1, y1, &c0, &c1, &r0, &r1))
+      for (r = r0; r <= r1; r++)
+        for (c = c0; c <= c1; c++)
+          first[r * cols + c + 1]++;
+  for (t = 0; t < tiles; t++)
+    first[t + 1] += first[t];
+  total = first[tiles];
+
+  if (nlist < total) {
+    nlist = total;
+    free(list);
+    list = checked_malloc(nlist * sizeof(int));
+  }
+  // Fill each tile's entries, moving its start up to the next tile's, and
+  // then move the starts back
+  for (i = 0; i < n; i++)
+    if (tile_span(&s[i], x0, y0, x1, y1, &c0, &c1, &r0, &r1))
+      for (r = r0; r <= r1; r++)
+        for (c = c0; c <= c1; c++)
+          list[first[r * cols + c]++] = i;
+  for (t = tiles; t > 0; t--)
+    first[t] = first[t - 1];
+  first[0] = 0;
+
+  *start = first;
+  *bins = list;
+}
+
+// Renders the region [x0,x1) x [y0,y1) of ti into out, which points at
+// pixel (x0,y0) and has rows stride bytes apart. With raster_tiled set, a
+// large region rendered outside a parallel region is split into tiles of
+// RASTER_TILE_W x RASTER_TILE_H pixels that are rendered on all threads at
+// once, each compositing only the triangles that overlap it.
+void raster_region(tri_image* ti, GLubyte* out, int stride,
+    int x0, int y0, int x1, int y1) {
+  raster_prepare(ti, x0, y0, x1, y1);
+  if (!raster_tiled || omp_in_parallel() ||
+      (long)(x1 - x0) * (y1 - y0) < RASTER_PARALLEL_MIN) {
+    raster_prepared(out, stride, x0, y0, x1, y1);
+    return;
+  }
+
+  // prepared is this thread's
+  tri_setup* s = prepared;
+  int n = nprepared;
+  int cols = (x1 - x0 + RASTER_TILE_W - 1) / RASTER_TILE_W;
+  int rows = (y1 - y0 + RASTER_TILE_H - 1) / RASTER_TILE_H;
+  int tiles = cols * rows;
+  int* start, * bins;
+  int t;
+  raster_bin(s, n, x0, y0, x1, y1, cols, tiles, &start, &bins);
+  #pragma omp parallel for schedule(dynamic)
+  for (t = 0; t < tiles; t++) {
+    int tx0 = x0 + (t % cols) * RASTER_TILE_W, ty0 = y0 + (t / cols) * RASTER_TILE_H;
+    int tx1 = MIN(tx0 + RASTER_TILE_W, x1), ty1 = MIN(ty0 + RASTER_TILE_H, y1);
+    GLubyte* tile = out + (ty0 - y0) * stride + (tx0 - x0) * 3;
+    int k;
+    raster_clear(tile, stride, tx0, ty0, tx1, ty1);
+    for (k = start[t]; k < start[t + 1]; k++)
+      raster_triangle(&s[bins[k]], tile, stride, tx0, ty0, tx1, ty1);
+  }
+}
+
+void raster_tri_image(tri_image* ti) {
+  image* img = ti->img;
+  image_alloc(img);
+  raster_region(ti, img->values, img->width * 3, 0, 0, img->width, img->height);
+  ti->state = 1;
+}
+
+typedef struct _ranked {
+  long error;
+  int index;
+} ranked;
+
+static int ranked_cmp(const void* a, const void* b) {
+  long ea = ((ranked*)a)->error, eb = ((ranked*)b)->error;
+  if (ea != eb)
+    return ea < eb ? 1 : -1;
+  return ((ranked*)a)->index - ((ranked*)b)->index;
+}
+
+// Fills order with 0 to n-1, sorted by decreasing error[i]
+void order_by_error(long* error, int n, int* order) {
+  static __thread ranked* r = NULL;
+  static __thread int capacity = 0;
+  int i;
+  if (capacity < n) {
+    capacity = n;
+    r = realloc(r, capacity * sizeof(ranked));
+    if (r == NULL) {
+      printf("Failed to allocate memory.\n");
+      exit(0);
+    }
+  }
+  for (i = 0; i < n; i++) {
+    r[i].error = error[i];
+    r[i].index = i;
+  }
+  qsort(r, n, sizeof(ranked), ranked_cmp);
+  for (i = 0; i < n; i++)
+    order[i] = r[i].index;
+}
+
+// A buffer of at least size bytes, reused between calls on the same thread
+static GLubyte* raster_scratch(int size) {
+  static __thread GLubyte* scratch = NULL;
+  static __thread int scratch_size = 0;
+  if (scratch_size < size) {
+    scratch_size = size;
+    scratch = realloc(scratch, scratch_size);
+    if (scratch == NULL) {
+      printf("Failed to allocate memory.\n");
+      exit(0);
+    }
+  }
+  return scratch;
+}
+
+// Computes the difference between ti and source without keeping the
+// rendered image. Strips of whole rows are rendered into a buffer of
+// about RASTER_STRIP bytes that stays in cache and compared against the
+// source right away, so ti->img->values is never needed. ti is rendered
+// at the size of source, which may be a level of the pyramid.
+//
+// Each strip's error is kept with ti. Strips are compared in decreasing
+// order of the parent's errors, so the worst regions come first, and
+// the sum is abandoned once it reaches ti->bound. With raster_tiled set,
+// the strips of a large source are shared between all threads when not
+// called from a parallel region; the sum is then of the strips compared
+// by the time one thread saw it reach the bound.
+long raster_diff(tri_image* ti, image* source) {
+  static __thread int* order = NULL;
+  static __thread int order_size = 0;
+  int w = source->width, h = source->height;
+  int rows = MAX(1, RASTER_STRIP / (w * 3));
+  int count = (h + rows - 1) / rows;
+  long ret = 0;
+  int n, k;
+
+  if (order_size < count) {
+    order_size = count;
+    order = realloc(order, order_size * sizeof(int));
+    if (order == NULL) {
+      printf("Failed to allocate memory.\n");
+      exit(0);
+    }
+  }
+  if (ti->nstrips != count) {
+    pool_free(ti->strip_error);
+    ti->strip_error = pool_alloc(count * sizeof(long));
+  }
+  ti->nstrips = 0; // until every strip is compared
+
+  if (ti->parent && ti->parent->nstrips == count) {
+    order_by_error(ti->parent->strip_error, count, order);
+  } else {
+    for (k = 0; k < count; k++)
+      order[k] = k;
+  }
+
+  tri_setup* s = setup_tri_image(ti, NULL, 0, w, h, 0, 0, w, h, &n);
+  if (raster_tiled && !omp_in_parallel() &&
+      (long)w * h >= RASTER_PARALLEL_MIN) {
+    // order and the setups are this thread's
+    int* o = order;
+    int stop = 0;
+    #pragma omp parallel for schedule(dynamic)
+    for (k = 0; k < count; k++) {
+      int done;
+      #pragma omp atomic read
+      done = stop;
+      if (done)
+        continue;
+      int y = o[k] * rows;
+      int sh = MIN(rows, h - y);
+      GLubyte* strip = raster_scratch(rows * w * 3);
+      raster_setups(s, n, strip, w * 3, 0, y, w, y + sh);
+      long e = region_diff(strip, w * 3, source, 0, y, w, sh);
+      ti->strip_error[o[k]] = e;
+      long sum;
+      #pragma omp atomic capture
+      sum = ret += e;
+      if (sum >= ti->bound) {
+        #pragma omp atomic write
+        stop = 1;
+      }
+    }
+    if (!stop)
+      ti->nstrips = count;
+    return ret;
+  }
+
+  GLubyte* strip = raster_scratch(rows * w * 3);
+  for (k = 0; k < count; k++) {
+    int y = order[k] * rows;
+    int sh = MIN(rows, h - y);
+    raster_setups(s, n, strip, w * 3, 0, y, w, y + sh);
+    ti->strip_error[order[k]] = region_diff(strip, w * 3, source, 0, y, w, sh);
+    ret += ti->strip_error[order[k]];
+    if (ret >= ti->bound)
+      return ret;
+  }
+  ti->nstrips = count;
+  return ret;
+}
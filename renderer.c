@@ -5,9 +5,11 @@
 // This file contains all the OpenGL related code for rendering tri_images
 // and showing the best image rendered.
 
+#define GL_GLEXT_PROTOTYPES
 #include <GL/glut.h> 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "tr.h"
 #include "wiproj.h"
 
@@ -31,34 +33,105 @@ tri_image*  (*mh_next)(void);
 tri_image*  (*mh_best)(void);
 void        (*mh_process)(tri_image*);
 
-void draw_tri_image(tri_image* ti) {
-  glClear(GL_COLOR_BUFFER_BIT);
-  int i;
-  glBegin(GL_TRIANGLES);
-  for (i = 0; i < ti->size; i++) {
-    triangle t = (ti->triangles)[i];
-    glColor4f(t.r,t.g,t.b,t.a);
-    glVertex2f(t.x1,t.y1);
-    glVertex2f(t.x2,t.y2);
-    glVertex2f(t.x3,t.y3);
+// The triangles last loaded on this thread, in a vertex buffer of its
+// context, three vertices of x, y, r, g, b, a each. A copy of what the
+// buffer holds is kept so that loading the next candidate, which usually
+// differs in a few triangles only, uploads just those.
+static __thread GLuint gl_buffer = 0;
+static __thread triangle* gl_loaded = NULL;
+static __thread GLfloat* gl_staging = NULL;
+static __thread int gl_count = 0, gl_capacity = 0;
+
+#define VBO_VERTEX_FLOATS 6
+#define VBO_TRIANGLE_FLOATS (3 * VBO_VERTEX_FLOATS)
+
+// Loads the n triangles t into the vertex buffer and points GL at it
+void load_triangles(triangle* t, int n) {
+  int i, k;
+  if (gl_buffer == 0)
+    glGenBuffers(1, &gl_buffer);
+  glBindBuffer(GL_ARRAY_BUFFER, gl_buffer);
+
+  if (gl_capacity < n) {
+    gl_capacity = MAX(n, 2 * gl_capacity);
+    free(gl_loaded);
+    free(gl_staging);
+    gl_loaded = checked_malloc(gl_capacity * sizeof(triangle));
+    gl_staging = checked_malloc(gl_capacity * VBO_TRIANGLE_FLOATS * sizeof(GLfloat));
+    glBufferData(GL_ARRAY_BUFFER, gl_capacity * VBO_TRIANGLE_FLOATS * sizeof(GLfloat),
+        NULL, GL_DYNAMIC_DRAW);
+    gl_count = 0; // nothing is loaded any more
+  }
+
+  // Upload each run of triangles that differ from the ones loaded
+  i = 0;
+  while (i < n) {
+    if (i < gl_count && memcmp(&t[i], &gl_loaded[i], sizeof(triangle)) == 0) {
+      i++;
+      continue;
+    }
+    int start = i;
+    for (; i < n && !(i < gl_count &&
+          memcmp(&t[i], &gl_loaded[i], sizeof(triangle)) == 0); i++) {
+      GLfloat* v = &gl_staging[i * VBO_TRIANGLE_FLOATS];
+      GLfloat x[3] = {t[i].x1, t[i].x2, t[i].x3};
+      GLfloat y[3] = {t[i].y1, t[i].y2, t[i].y3};
+      for (k = 0; k < 3; k++, v += VBO_VERTEX_FLOATS) {
+        v[0] = x[k]; v[1] = y[k];
+        v[2] = t[i].r; v[3] = t[i].g; v[4] = t[i].b; v[5] = t[i].a;
+      }
+      gl_loaded[i] = t[i];
+    }
+    glBufferSubData(GL_ARRAY_BUFFER,
+        start * VBO_TRIANGLE_FLOATS * sizeof(GLfloat),
+        (i - start) * VBO_TRIANGLE_FLOATS * sizeof(GLfloat),
+        &gl_staging[start * VBO_TRIANGLE_FLOATS]);
   }
-  glEnd();
+  gl_count = n;
+
+  glEnableClientState(GL_VERTEX_ARRAY);
+  glEnableClientState(GL_COLOR_ARRAY);
+  glVertexPointer(2, GL_FLOAT, VBO_VERTEX_FLOATS * sizeof(GLfloat), (GLvoid*)0);
+  glColorPointer(4, GL_FLOAT, VBO_VERTEX_FLOATS * sizeof(GLfloat),
+      (GLvoid*)(2 * sizeof(GLfloat)));
+}
+
+// Draws the triangles last loaded
+void draw_loaded() {
+  glClear(GL_COLOR_BUFFER_BIT);
+  glDrawArrays(GL_TRIANGLES, 0, gl_count * 3);
+}
+
+void draw_tri_image(tri_image* ti) {
+  materialize(ti);
+  load_triangles(ti->triangles, ti->size);
+  draw_loaded();
+}
+
+// Renders ti into ti->img in tiles of at most tile_w x tile_h pixels, the
+// size of the framebuffer of the current context, less border on each
+// side. The triangles are loaded once for all the tiles.
+void render_tri_image(tri_image* ti, int tile_w, int tile_h, int border) {
+  image_alloc(ti->img);
+  materialize(ti);
+  load_triangles(ti->triangles, ti->size);
+  TRcontext* t = trNew();
+  trTileSize(t, tile_w, tile_h, border);
+  trImageSize(t, ti->img->width, ti->img->height);
+  trImageBuffer(t, GL_RGB, GL_UNSIGNED_BYTE, ti->img->values);
+  trOrtho(t, 0.0, 1.0, 0.0, 1.0, -1.0, 1.0);
+  do {
+    trBeginTile(t);
+    draw_loaded();
+  } while (trEndTile(t));
+  trDelete(t);
+  ti->state = 1;
 }
 
 void display() { 
   if (render->state == 0) {
     // render this tri_image
-    TRcontext* t = trNew();
-    trTileSize(t,window_width,window_height,BORDER);
-    trImageSize(t,render->img->width,render->img->height);
-    trImageBuffer(t, GL_RGB, GL_UNSIGNED_BYTE, render->img->values);
-    trOrtho(t,0.0,1.0,0.0,1.0,-1.0,1.0);
-    do {
-      trBeginTile(t);
-      draw_tri_image(render);
-    } while (trEndTile(t));
-    trDelete(t);
-    render->state = 1;
+    render_tri_image(render, window_width, window_height, BORDER);
   }
 
   if (update_show == 1) {
@@ -87,14 +160,13 @@ void reshape(GLsizei w, GLsizei h) {
 }
 
 void keyboard (unsigned char key, int x, int y) {
-  if (key == 'q') exit(0);
-  if (key == 's') {
-    char buf[20];
-    snprintf(buf,20,"%d.ppm",shown->generation);
-    FILE* out = fopen(buf, "wb");
-    write_ppm(out,shown->img);
-    fclose(out);
+  if (key == 'q') {
+    snapshot_finish();
+    exit(0);
   }
+  // Written by the snapshot thread, so the search doesn't wait
+  if (key == 's')
+    snapshot_save(shown);
   glutPostRedisplay();
 }
 
@@ -110,6 +182,7 @@ void idle() {
     update_show = 1;
     shown = temp;
   }
+  snapshot_tick(shown);
 
 }
 
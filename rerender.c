@@ -0,0 +1,103 @@
+// Kevin Stock
+
+// This is the main of a tool that draws a genome written by main (see
+// genome.c) at any resolution, since only the triangles are needed to
+// draw them again. By default it uses the software rasterizer, with the
+// image split into tiles rendered on all threads at once; with -gl it
+// renders with OpenGL into an offscreen pbuffer, in tiles with tr.c when
+// the image is larger.
+
+#include "wiproj.h"
+#include <stdlib.h>
+#include <string.h>
+
+void usage() {
+  printf("First argument should be a genome file written by main -genome,\n"
+      "optionally followed by\n"
+      "  -size WxH     size to render at (the original's)\n"
+      "  -scale S      size to render at, as a multiple of the original's\n"
+      "  -gl           render with OpenGL instead of the software rasterizer\n"
+      "  -out FILE     .ppm or .png to write (render.ppm)\n"
+      "  -svg FILE     also write an SVG of the triangles\n");
+}
+
+char* option_value(int argc, char** argv, int* i) {
+  if (*i + 1 >= argc) {
+    printf("%s needs a value.\n", argv[*i]);
+    exit(0);
+  }
+  return argv[++*i];
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    usage();
+    return 0;
+  }
+  int gl = 0, w = 0, h = 0, i;
+  double scale = 0;
+  char* output = "render.ppm";
+  char* svg = NULL;
+  for (i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "-gl") == 0)
+      gl = 1;
+    else if (strcmp(argv[i], "-size") == 0) {
+      if (sscanf(option_value(argc, argv, &i), "%dx%d", &w, &h) != 2) {
+        printf("-size should be WxH.\n");
+        return 0;
+      }
+    } else if (strcmp(argv[i], "-scale") == 0)
+      scale = atof(option_value(argc, argv, &i));
+    else if (strcmp(argv[i], "-out") == 0)
+      output = option_value(argc, argv, &i);
+    else if (strcmp(argv[i], "-svg") == 0)
+      svg = option_value(argc, argv, &i);
+  }
+
+  FILE* input = fopen(argv[1], "rb");
+  if (input == NULL) {
+    printf("Can't open %s.\n", argv[1]);
+    return 0;
+  }
+  tri_image* ti = read_genome(input);
+  fclose(input);
+
+  if (scale > 0) {
+    w = ti->img->width * scale + 0.5;
+    h = ti->img->height * scale + 0.5;
+  }
+  if (w > 0 && h > 0) {
+    ti->img->width = w;
+    ti->img->height = h;
+  }
+  printf("%d triangles at %dx%d\n", ti->size, ti->img->width, ti->img->height);
+
+  if (gl) {
+    int tw, th;
+    offscreen_context(ti->img->width, ti->img->height, &tw, &th);
+    myInit();
+    render_tri_image(ti, tw, th, 0);
+  } else {
+    raster_tiled = 1;
+    raster_tri_image(ti);
+  }
+
+  FILE* out = fopen(output, "wb");
+  if (out == NULL) {
+    printf("Can't open %s.\n", output);
+    return 0;
+  }
+  write_image(out, ti->img, output);
+  fclose(out);
+
+  if (svg) {
+    out = fopen(svg, "w");
+    if (out == NULL) {
+      printf("Can't open %s.\n", svg);
+      return 0;
+    }
+    write_svg(out, ti);
+    fclose(out);
+  }
+  return 0;
+}
@@ -0,0 +1,178 @@
+// Kevin Stock
+
+// This file contains snapshots of the best tri_image, written while the
+// search goes on. A driver hands snapshot_save the best; it is copied,
+// triangles and any rendered pixels, so the metaheuristic is free to
+// drop it, and queued for a thread of its own. That thread renders the
+// copy if it has no pixels, by itself so as not to take cores from the
+// search, and writes it to <snapshot_prefix><generation>.ppm, and a
+// genome beside it if headless_genome is set.
+//
+// The queue holds at most SNAPSHOT_QUEUE copies. When the disk can't
+// keep up, the newest queued copy is replaced rather than the search
+// made to wait, so only snapshots nobody would have looked at are lost.
+//
+// snapshot_tick takes one on its own every snapshot_interval seconds,
+// or whenever the best error has improved by a fraction snapshot_gain
+// since the last, if either is set.
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "wiproj.h"
+
+#define SNAPSHOT_QUEUE 4
+
+double snapshot_interval = 0; // seconds between snapshots, 0 for none
+double snapshot_gain = 0;     // improvement that takes one, 0 for none
+char* snapshot_prefix = "";
+long snapshot_dropped = 0;
+
+pthread_t snap_thread;
+pthread_mutex_t snap_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t snap_cond = PTHREAD_COND_INITIALIZER;
+tri_image* snap_queue[SNAPSHOT_QUEUE]; // guarded by snap_lock
+int snap_first = 0, snap_count = 0;
+int snap_started = 0;
+int snap_done = 0;
+
+// Last snapshot taken, for snapshot_tick
+int snap_generation = -1, snap_level = -1;
+long snap_error = 0;
+double snap_time = 0;
+
+// The name of the file for generation gen with extension ext, which the
+// caller frees
+char* snapshot_name(int gen, const char* ext) {
+  size_t len = strlen(snapshot_prefix) + strlen(ext) + 16;
+  char* ret = checked_malloc(len);
+  snprintf(ret, len, "%s%d.%s", snapshot_prefix, gen, ext);
+  return ret;
+}
+
+// A copy of ti that shares nothing with it
+tri_image* snapshot_copy(tri_image* ti) {
+  int i;
+  tri_image* ret = new_tri_image(ti->size, ti->generation,
+      ti->img->width, ti->img->height);
+  for (i = 0; i < ti->size; i++)
+    get_triangle(ti, i, &ret->triangles[i]);
+  ret->error = ti->error;
+  if (ti->state > 0 && ti->img->values) {
+    image_alloc(ret->img);
+    memcpy(ret->img->values, ti->img->values, ti->img->width * ti->img->height * 3);
+    ret->state = ti->state;
+  }
+  return ret;
+}
+
+void snapshot_write(tri_image* ti) {
+  image* img = ti->img;
+  if (img->values == NULL) {
+    // On this thread alone: raster_tri_image would, with raster_tiled,
+    // start a team of threads competing with the search for cores
+    image_alloc(img);
+    raster_prepare(ti, 0, 0, img->width, img->height);
+    raster_prepared(img->values, img->width * 3, 0, 0, img->width, img->height);
+  }
+  char* name = snapshot_name(ti->generation, "ppm");
+  FILE* out = fopen(name, "wb");
+  if (out == NULL) {
+    printf("Can't open %s.\n", name);
+  } else {
+    write_ppm(out, img);
+    fclose(out);
+  }
+  free(name);
+  if (headless_genome) {
+    name = snapshot_name(ti->generation, "wpg");
+    out = fopen(name, "wb");
+    write_genome(out, ti);
+    if (out)
+      fclose(out);
+    free(name);
+  }
+}
+
+void* snapshot_writer(void* arg) {
+  pthread_mutex_lock(&snap_lock);
+  for (;;) {
+    while (snap_count == 0 && !snap_done)
+      pthread_cond_wait(&snap_cond, &snap_lock);
+    if (snap_count == 0)
+      break;
+    tri_image* ti = snap_queue[snap_first];
+    snap_first = (snap_first + 1) % SNAPSHOT_QUEUE;
+    snap_count--;
+    pthread_mutex_unlock(&snap_lock);
+    snapshot_write(ti);
+    free_tri_image(ti);
+    pthread_mutex_lock(&snap_lock);
+  }
+  pthread_mutex_unlock(&snap_lock);
+  return NULL;
+}
+
+// Queues a copy of ti to be written
+void snapshot_save(tri_image* ti) {
+  tri_image* copy = snapshot_copy(ti);
+  tri_image* dropped = NULL;
+
+  snap_generation = ti->generation;
+  snap_level = pyr_level;
+  snap_error = ti->error;
+  snap_time = omp_get_wtime();
+
+  pthread_mutex_lock(&snap_lock);
+  if (!snap_started) {
+    if (pthread_create(&snap_thread, NULL, snapshot_writer, NULL) != 0) {
+      printf("Failed to start the snapshot thread.\n");
+      exit(0);
+    }
+    snap_started = 1;
+  }
+  if (snap_count == SNAPSHOT_QUEUE) {
+    int last = (snap_first + snap_count - 1) % SNAPSHOT_QUEUE;
+    dropped = snap_queue[last];
+    snap_queue[last] = copy;
+    snapshot_dropped++;
+  } else {
+    snap_queue[(snap_first + snap_count++) % SNAPSHOT_QUEUE] = copy;
+  }
+  pthread_cond_signal(&snap_cond);
+  pthread_mutex_unlock(&snap_lock);
+  free_tri_image(dropped);
+}
+
+// Called by a driver with the current best between batches; takes a
+// snapshot if one is due
+void snapshot_tick(tri_image* best) {
+  if (best == NULL || best->generation == snap_generation)
+    return;
+  double now = omp_get_wtime();
+  if (snap_time == 0)
+    snap_time = now;
+  // Errors against different levels of the pyramid can't be compared
+  if (snap_level != pyr_level) {
+    snap_level = pyr_level;
+    snap_error = best->error;
+  }
+  if ((snapshot_interval > 0 && now - snap_time >= snapshot_interval) ||
+      (snapshot_gain > 0 && best->error <= snap_error * (1 - snapshot_gain)))
+    snapshot_save(best);
+}
+
+// Called by a driver when the run stops; waits for the queued snapshots
+// to be written
+void snapshot_finish() {
+  if (!snap_started)
+    return;
+  pthread_mutex_lock(&snap_lock);
+  snap_done = 1;
+  pthread_cond_signal(&snap_cond);
+  pthread_mutex_unlock(&snap_lock);
+  pthread_join(snap_thread, NULL);
+  snap_started = snap_done = 0;
+  if (snapshot_dropped > 0)
+    printf("Snapshots dropped while the disk was busy: %ld\n", snapshot_dropped);
+}
@@ -7,14 +7,57 @@
 #include <stdio.h>
 #include <time.h>
 #include <omp.h>
+#include <limits.h>
 
 #define WIPROJ_VERSION "0.1"
 
 #define MIN(a,b) ((a)>(b)?(b):(a))
 #define MAX(a,b) ((a)<(b)?(b):(a))
 
-// Compare with rgb or hsv?
-#define RGB_COMP 1
+// Metrics image_diff can compare with, see set_metric
+#define METRIC_RGB 0
+#define METRIC_HSV 1
+
+// Pixels converted to hsv at a time, on the stack
+#define HSV_CHUNK 256
+
+// Fewest pixels image_diff splits between threads
+#define DIFF_PARALLEL_MIN (512*512)
+
+// Side of the square tiles incremental evaluation tracks error for
+#define INC_TILE 32
+
+// Side of the square cells the spatial index of triangles is kept for
+#define GRID_TILE 32
+
+// Alignment of tri_soa arrays, and the multiple their capacity is
+// rounded up to, a cache line and whole SIMD registers
+#define SOA_ALIGN 64
+
+// Coarse to fine evaluation: the coarsest pyramid level is at least
+// PYRAMID_MIN pixels on its shorter side. Candidates move one level finer
+// once PYRAMID_WINDOW evaluations improve the best error by less than a
+// fraction PYRAMID_PLATEAU.
+#define PYRAMID_MIN 64
+#define PYRAMID_MAX_LEVELS 8
+#define PYRAMID_WINDOW 2000
+#define PYRAMID_PLATEAU 0.01
+
+// Targeted mutation: the width of the box, in [0,1] coordinates, that the
+// vertices of a triangle added at a high error tile are spread over
+#define TARGET_SPREAD 0.25
+
+// Bytes of scratch raster_diff renders into at a time, small enough to
+// stay in cache
+#define RASTER_STRIP 65536
+
+// Tile-parallel rendering (see raster_tiled): the size of the tiles a
+// region is split into, wide and short so that a triangle's rows are set
+// up for few tiles and a tile stays in cache, and the fewest pixels worth
+// splitting
+#define RASTER_TILE_W 512
+#define RASTER_TILE_H 32
+#define RASTER_PARALLEL_MIN (512*512)
 
 typedef struct _image {
   int width, height;
@@ -30,19 +73,73 @@ typedef struct _triangle {
   GLfloat r, g, b, a;
 } triangle;
 
-typedef struct _tri_image {
+// A changed field of a triangle, see copy_tri_image in mh.c
+typedef struct _delta {
+  int tri;        // index of the triangle
+  int field;      // 0-9 for x1, y1, x2, y2, x3, y3, r, g, b, a
+  GLfloat value;
+} delta;
+
+// Triangles stored as one array per field, numbered as in delta, so that
+// many triangles can be processed at once with SIMD; see tri_image_soa
+typedef struct _tri_soa {
+  int size, capacity;
+  GLfloat * f[10]; // f[field][triangle], SOA_ALIGN byte aligned
+} tri_soa;
+
+// Re-rendered tiles of an incrementally evaluated tri_image, see incr.c
+typedef struct _patch patch;
+
+// A checkpoint being built or read back, see checkpoint.c
+typedef struct _ckpt {
+  unsigned char * data;
+  size_t size, capacity;
+  size_t pos; // of the next value read
+} ckpt;
+
+typedef struct _tri_image tri_image;
+struct _tri_image {
   long error;
   /* State Values:
    * 0 - Incomplete: img->values = null, error = 0 // Made by mh
    * 1 - Partial: img complete, error = 0          // Done by renderer
    * 2 - Complete                                  // Set by mh in process
+   * A renderer may leave a tri_image incomplete, in which case mh computes
+   * the error with raster_diff without ever allocating img->values.
    */
   int state;
   int generation; 
   int size; // number of triangles
-  triangle * triangles;
+  triangle * triangles; // null until materialized, for a copy on write
   image * img;
-} tri_image;
+
+  /* Copy on write: until triangles is allocated, the triangles are the
+   * parent's with deltas applied, at most one per field */
+  delta * deltas;
+  int ndeltas, cdeltas; // used and allocated
+
+  /* The owner's reference plus one for every tri_image with this one as
+   * parent; freed when it reaches 0, see free_tri_image */
+  int refs;
+
+  /* Incremental evaluation: the tri_image this one was copied from (kept
+   * until this one is accepted), and the bounding box in [0,1] of every
+   * triangle changed since, as xmin, ymin, xmax, ymax. The box is empty
+   * when xmin > xmax. */
+  tri_image * parent;
+  float dirty[4];
+  patch * patch;
+
+  /* Early exit: evaluation may stop once the error is known to be at
+   * least bound, leaving error somewhere at or above it. LONG_MAX unless
+   * the metaheuristic rejects anything no better than some error. */
+  long bound;
+
+  /* The error of each strip raster_diff compared, if it compared all
+   * nstrips of them */
+  long * strip_error;
+  int nstrips;
+};
 
 /* renderer.c */
 extern void start (
@@ -51,41 +148,180 @@ extern void start (
     tri_image*  (*best)(void), 
     void        (*process)(tri_image*));
 
+extern void myInit(void);
+extern void load_triangles(triangle* t, int n);
+extern void draw_loaded(void);
+extern void draw_tri_image(tri_image* ti);
+extern void render_tri_image(tri_image* ti, int tile_w, int tile_h, int border);
+
+/* offscreen.c */
+extern int offscreen_preview;
+extern void offscreen_context(int w, int h, int* tw, int* th);
+extern void start_offscreen (
+    int argc, char** argv,
+    int         (*next_batch)(tri_image**, int),
+    tri_image*  (*best)(void),
+    void        (*process_batch)(tri_image**, int));
+
+/* headless.c */
+extern int headless_fused;
+extern int headless_batch;
+extern long headless_budget;
+extern double headless_time;
+extern char* headless_output;
+extern char* headless_genome;
+extern char* headless_svg;
+extern void save_best(tri_image* ti);
+extern void start_headless (
+    int         (*next_batch)(tri_image**, int),
+    tri_image*  (*best)(void),
+    void        (*process_batch)(tri_image**, int));
+
+/* genome.c */
+extern int genome_compress;
+extern void write_genome(FILE* file, tri_image* ti);
+extern tri_image* read_genome(FILE* file);
+extern void write_svg(FILE* file, tri_image* ti);
+
+/* snapshot.c */
+extern double snapshot_interval;
+extern double snapshot_gain;
+extern char* snapshot_prefix;
+extern char* snapshot_name(int gen, const char* ext);
+extern void snapshot_save(tri_image* ti);
+extern void snapshot_tick(tri_image* best);
+extern void snapshot_finish(void);
+
+/* checkpoint.c */
+extern char* checkpoint_path;
+extern double checkpoint_interval;
+extern void ckpt_put(ckpt* c, const void* p, size_t n);
+extern void ckpt_get(ckpt* c, void* p, size_t n);
+extern void checkpoint_tick(void);
+extern void checkpoint_finish(void);
+extern void checkpoint_resume(void);
+
+/* raster.c */
+extern int raster_tiled;
+extern void raster_region (
+    tri_image* ti,
+    GLubyte* out, int stride,
+    int x0, int y0, int x1, int y1);
+extern void raster_prepare(tri_image* ti, int x0, int y0, int x1, int y1);
+extern void raster_prepare_list(tri_image* ti, int* list, int n,
+    int x0, int y0, int x1, int y1);
+extern void raster_prepared (
+    GLubyte* out, int stride,
+    int x0, int y0, int x1, int y1);
+extern void raster_tri_image(tri_image* ti);
+extern void order_by_error(long* error, int n, int* order);
+extern long raster_diff(tri_image* ti, image* source);
+
+/* incr.c */
+extern int inc_enabled;
+extern int inc_cols, inc_rows;
+extern image* inc_source;
+extern void inc_init(image* source);
+extern int inc_evaluate(tri_image* ti);
+extern void inc_accept(tri_image* ti);
+extern void inc_release(tri_image* ti);
+extern int inc_pick(double u);
+
+/* grid.c */
+extern int grid_cols, grid_rows;
+extern void grid_init(int w, int h);
+extern void grid_update(triangle* t, int n);
+extern int* grid_query(tri_image* ti, int x0, int y0, int x1, int y1, int* n);
+
+/* pool.c */
+extern long pool_hits, pool_misses;
+extern size_t pool_bytes;
+extern void* checked_malloc(size_t size);
+extern void* pool_alloc(size_t size);
+extern void pool_free(void* p);
+extern void pool_print_stats(void);
+
 /* image.c */
+extern int diff_metric;
+extern void set_metric(int metric, image* source);
 extern long image_diff (
     image * a,
     image * b);
+extern long region_diff (
+    GLubyte * a, int stride,
+    image * b,
+    int x, int y, int w, int h);
+extern void image_alloc(image* img);
+extern image** pyramid;
+extern int pyramid_levels;
+extern void build_pyramid(image* source);
 extern image* load_ppm(FILE* file);
 extern void write_ppm(FILE* file,image* img);
 
+/* codec.c */
+extern image* load_png(FILE* file);
+extern image* load_jpeg(FILE* file);
+extern void write_png(FILE* file, image* img);
+extern image* load_image(FILE* file);
+extern void write_image(FILE* file, image* img, const char* name);
+
 
 
 /* mh.c */
+extern unsigned long long mh_seed;
+extern int mh_targeted;
+extern int mh_deterministic;
 extern void mh_init(void);
+extern int generation;
+extern image* isource;
+extern void mh_save(ckpt* c);
+extern void mh_load(ckpt* c);
+extern tri_image* new_tri_image(int size, int gen, int w, int h);
+extern void free_tri_image(tri_image* ti);
+extern void get_triangle(tri_image* ti, int i, triangle* out);
+extern void materialize(tri_image* ti);
+extern void soa_reserve(tri_soa* s, int n);
+extern void tri_to_soa(triangle* t, int n, tri_soa* s);
+extern void tri_from_soa(tri_soa* s, triangle* t);
+extern void tri_image_soa(tri_image* ti, tri_soa* s);
+extern void tri_image_soa_list(tri_image* ti, int* list, int n, tri_soa* s);
+extern void evaluate(tri_image* ti);
+extern int pyr_level;
+extern void pyr_check(tri_image* best, int n);
 
 extern tri_image* shc_next(void);
 extern tri_image* shc_best(void);
 extern void shc_process(tri_image* ti);
+extern int shc_next_batch(tri_image** batch, int n);
+extern void shc_process_batch(tri_image** batch, int n);
 extern void shc_init(image* source, int size);
 
 extern tri_image* ashc_next(void);
 extern tri_image* ashc_best(void);
 extern void ashc_process(tri_image* ti);
+extern int ashc_next_batch(tri_image** batch, int n);
+extern void ashc_process_batch(tri_image** batch, int n);
 extern void ashc_init(image* source, int size);
 
 extern tri_image* sa_next(void);
 extern tri_image* sa_best(void);
 extern void sa_process(tri_image* ti);
+extern int sa_next_batch(tri_image** batch, int n);
+extern void sa_process_batch(tri_image** batch, int n);
 extern void sa_init(image* source, int size);
 
 extern tri_image* acc_next(void);
 extern tri_image* acc_best(void);
 extern void acc_process(tri_image* ti);
+extern int acc_next_batch(tri_image** batch, int n);
+extern void acc_process_batch(tri_image** batch, int n);
 extern void acc_init(image* source, int size);
 
 extern tri_image* ga_next(void);
 extern tri_image* ga_best(void);
 extern void ga_process(tri_image* ti);
+extern int ga_next_batch(tri_image** batch, int n);
+extern void ga_process_batch(tri_image** batch, int n);
 extern void ga_init(image* source, int tsize, int psize);
 
 #endif